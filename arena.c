@@ -0,0 +1,103 @@
+/*
+ * Memory for the packet buffers
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "tsdumper2.h"
+
+#define ARENA_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * The buffers of all static packets are in one mapping that is backed
+ * by huge pages when possible (MAP_HUGETLB, then transparent huge pages)
+ * and is prefaulted at start, so filling the packets never page faults.
+ * The pages are touched on the CPU of the input thread, so they are on
+ * its NUMA node.
+ */
+struct arena {
+	uint8_t				*mem;
+	size_t				size;
+};
+
+static const char *arena_map(struct arena *a) {
+#ifdef MAP_HUGETLB
+	// Needs reserved pages (vm.nr_hugepages)
+	a->mem = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (a->mem != MAP_FAILED)
+		return "huge pages";
+#endif
+	a->mem = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (a->mem == MAP_FAILED)
+		die("Can't map %lu bytes for packet buffers: %s\n", (unsigned long)a->size, strerror(errno));
+	const char *type = "4k pages";
+#ifdef MADV_HUGEPAGE
+	if (madvise(a->mem, a->size, MADV_HUGEPAGE) == 0)
+		type = "transparent huge pages";
+#endif
+	memset(a->mem, 0, a->size); // Prefault
+	return type;
+}
+
+void arena_init(struct ts *ts) {
+	struct arena *a;
+	int i;
+
+	a = calloc(1, sizeof(struct arena));
+	ts->packets = calloc(ts->num_packets, sizeof(struct packet));
+	if (!a || !ts->packets)
+		die("Can't alloc %lu bytes.\n", (unsigned long)(sizeof(struct arena) + ts->num_packets * sizeof(struct packet)));
+	a->size = (size_t)ts->num_packets * PACKET_MAX_LENGTH;
+	a->size = (a->size + ARENA_HUGEPAGE_SIZE - 1) & ~((size_t)ARENA_HUGEPAGE_SIZE - 1);
+
+#ifdef __linux__
+	// The input thread is pinned later, allocate the pages on its node
+	cpu_set_t old_cpus, cpus;
+	int pinned = 0;
+	if (ts->busy_poll && ts->busy_poll_cpu < CPU_SETSIZE &&
+	    sched_getaffinity(0, sizeof(old_cpus), &old_cpus) == 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(ts->busy_poll_cpu, &cpus);
+		pinned = sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+	}
+#endif
+	const char *type = arena_map(a);
+#ifdef __linux__
+	if (pinned)
+		sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+#endif
+
+	for (i = 0; i < ts->num_packets; i++) {
+		struct packet *p = &ts->packets[i];
+		p->num  = i + 1;
+		p->data = a->mem + (size_t)i * PACKET_MAX_LENGTH;
+	}
+	ts->arena = a;
+	p_info("Buffers    : %d x %d bytes (%lu MB, %s)\n", ts->num_packets, PACKET_MAX_LENGTH,
+		(unsigned long)(a->size / (1024 * 1024)), type);
+}
+
+void arena_free(struct ts *ts) {
+	struct arena *a = ts->arena;
+	munmap(a->mem, a->size);
+	free(a);
+	free(ts->packets);
+	ts->arena   = NULL;
+	ts->packets = NULL;
+}
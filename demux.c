@@ -0,0 +1,339 @@
+/*
+ * Split multi program transport stream into single program files
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsdumper2.h"
+
+#define MAX_PIDS      8192
+#define MAX_ES_PIDS   64
+
+// PIDs below this (CAT, NIT, SDT, EIT, TDT...) are written in every output
+#define PID_SI_MAX    0x20
+
+#define PID_IS_PMT    0x01
+
+struct demux_program {
+	int					program;
+	int					pmt_pid;					// -1 == not in PAT
+	int					pmt_version;				// -1 == not parsed yet
+	int					pcr_pid;
+	int					num_es_pids;
+	uint16_t			es_pids[MAX_ES_PIDS];
+	struct psi_buf		pmt;
+
+	struct output		*out;
+	uint8_t				pat[TS_PACKET_SIZE];		// single program PAT
+	uint8_t				pat_cc;
+};
+
+struct demux {
+	uint64_t			pid_map[MAX_PIDS];			// bit N is set for ts->outputs[N]
+	uint8_t				pid_flags[MAX_PIDS];
+
+	int					all;						// split all programs
+	int					num_selected;
+	int					selected[MAX_OUTPUTS];
+
+	struct psi_buf		pat;
+	int					pat_version;				// -1 == not parsed yet
+	uint16_t			tsid;
+
+	int					num_programs;
+	struct demux_program programs[MAX_OUTPUTS];
+};
+
+// Null packets are never copied (pcr_pid 0x1fff == program without PCR)
+static void demux_map_pid(struct demux *d, int pid, int idx) {
+	if (pid >= 0 && pid < MAX_PIDS && pid != 0x1fff)
+		d->pid_map[pid] |= 1ULL << idx;
+}
+
+// Rebuild PID -> outputs table after PAT or PMT change
+static void demux_build_map(struct ts *ts) {
+	struct demux *d = ts->demux;
+	int i, j, pid;
+
+	memset(d->pid_map, 0, sizeof(d->pid_map));
+	memset(d->pid_flags, 0, sizeof(d->pid_flags));
+
+	for (i = 0; i < d->num_programs; i++) {
+		struct demux_program *prg = &d->programs[i];
+		if (prg->pmt_pid < 0)
+			continue;
+		int idx = prg->out->index;
+		d->pid_flags[prg->pmt_pid] |= PID_IS_PMT;
+		demux_map_pid(d, prg->pmt_pid, idx);
+		demux_map_pid(d, prg->pcr_pid, idx);
+		for (j = 0; j < prg->num_es_pids; j++)
+			demux_map_pid(d, prg->es_pids[j], idx);
+		for (pid = 1; pid < PID_SI_MAX; pid++)
+			demux_map_pid(d, pid, idx);
+	}
+}
+
+static void demux_build_pat(struct ts *ts, struct demux_program *prg) {
+	struct demux *d = ts->demux;
+	uint8_t *pkt = prg->pat;
+	uint8_t *sec = pkt + 5;
+
+	memset(pkt, 0xff, TS_PACKET_SIZE);
+	pkt[0] = 0x47;
+	pkt[1] = 0x40;									// payload_unit_start, PID 0
+	pkt[2] = 0x00;
+	pkt[3] = 0x10;									// payload only, CC is set on output
+	pkt[4] = 0x00;									// pointer_field
+
+	sec[0]  = 0x00;									// table_id
+	sec[1]  = 0xb0;									// section_syntax_indicator, length 13
+	sec[2]  = 13;
+	sec[3]  = d->tsid >> 8;
+	sec[4]  = d->tsid & 0xff;
+	sec[5]  = 0xc1 | ((d->pat_version & 0x1f) << 1); // current_next_indicator
+	sec[6]  = 0;									// section_number
+	sec[7]  = 0;									// last_section_number
+	sec[8]  = prg->program >> 8;
+	sec[9]  = prg->program & 0xff;
+	sec[10] = 0xe0 | (prg->pmt_pid >> 8);
+	sec[11] = prg->pmt_pid & 0xff;
+	uint32_t crc = ts_crc32(sec, 12);
+	sec[12] = crc >> 24;
+	sec[13] = crc >> 16;
+	sec[14] = crc >> 8;
+	sec[15] = crc;
+}
+
+static int demux_selected(struct demux *d, int program) {
+	int i;
+	if (d->all)
+		return 1;
+	for (i = 0; i < d->num_selected; i++) {
+		if (d->selected[i] == program)
+			return 1;
+	}
+	return 0;
+}
+
+static struct demux_program *demux_find(struct demux *d, int program) {
+	int i;
+	for (i = 0; i < d->num_programs; i++) {
+		if (d->programs[i].program == program)
+			return &d->programs[i];
+	}
+	return NULL;
+}
+
+static struct demux_program *demux_add(struct ts *ts, int program) {
+	struct demux *d = ts->demux;
+	if (d->num_programs >= MAX_OUTPUTS) {
+		p_info(" *** Too many programs, program %d is not recorded ***\n", program);
+		return NULL;
+	}
+	struct demux_program *prg = &d->programs[d->num_programs++];
+	memset(prg, 0, sizeof(*prg));
+	prg->program     = program;
+	prg->pmt_pid     = -1;
+	prg->pmt_version = -1;
+	prg->pcr_pid     = -1;
+	prg->out         = output_new(ts, program);
+	return prg;
+}
+
+static void demux_pat(struct ts *ts, uint8_t *sec, int sec_len) {
+	struct demux *d = ts->demux;
+	int i, pos;
+
+	if (sec[0] != 0x00 || sec_len < 12 || ts_crc32(sec, sec_len) != 0)
+		return;
+	if (!(sec[5] & 0x01)) // Not applicable yet
+		return;
+	int version = (sec[5] >> 1) & 0x1f;
+	if (version == d->pat_version)
+		return;
+	d->pat_version = version; // Report unsupported PAT once per version
+	if (sec[6] != 0 || sec[7] != 0) {
+		p_info(" *** PAT with more than one section is not supported ***\n");
+		return;
+	}
+
+	d->tsid = (sec[3] << 8) | sec[4];
+	p_info("PAT        : version %d, transport_stream_id %d\n", version, d->tsid);
+
+	for (i = 0; i < d->num_programs; i++)
+		d->programs[i].pmt_pid = -1;
+
+	for (pos = 8; pos + 4 <= sec_len - 4; pos += 4) {
+		int program = (sec[pos] << 8) | sec[pos + 1];
+		int pmt_pid = ((sec[pos + 2] & 0x1f) << 8) | sec[pos + 3];
+		if (program == 0) // NIT
+			continue;
+		struct demux_program *prg = demux_find(d, program);
+		if (!prg) {
+			if (!demux_selected(d, program))
+				continue;
+			prg = demux_add(ts, program);
+			if (!prg)
+				continue;
+		}
+		if (prg->pmt_pid != pmt_pid) {
+			prg->pmt_version = -1;
+			prg->num_es_pids = 0;
+			prg->pcr_pid     = -1;
+		}
+		prg->pmt_pid = pmt_pid;
+		p_info("PAT        : program %d, PMT pid %d\n", program, pmt_pid);
+	}
+
+	for (i = 0; i < d->num_programs; i++) {
+		struct demux_program *prg = &d->programs[i];
+		if (prg->pmt_pid < 0)
+			p_info("PAT        : program %d is not in the stream\n", prg->program);
+		else
+			demux_build_pat(ts, prg);
+	}
+	demux_build_map(ts);
+}
+
+static void demux_pmt(struct ts *ts, struct demux_program *prg, uint8_t *sec, int sec_len) {
+	int pos;
+
+	if (sec[0] != 0x02 || sec_len < 16 || ts_crc32(sec, sec_len) != 0)
+		return;
+	if (!(sec[5] & 0x01))
+		return;
+	int program = (sec[3] << 8) | sec[4];
+	if (program != prg->program)
+		return;
+	int version = (sec[5] >> 1) & 0x1f;
+	if (version == prg->pmt_version)
+		return;
+
+	prg->pmt_version = version;
+	prg->pcr_pid     = ((sec[8] & 0x1f) << 8) | sec[9];
+	prg->num_es_pids = 0;
+
+	pos = 12 + (((sec[10] & 0x0f) << 8) | sec[11]);
+	while (pos + 5 <= sec_len - 4 && prg->num_es_pids < MAX_ES_PIDS) {
+		prg->es_pids[prg->num_es_pids++] = ((sec[pos + 1] & 0x1f) << 8) | sec[pos + 2];
+		pos += 5 + (((sec[pos + 3] & 0x0f) << 8) | sec[pos + 4]);
+	}
+
+	p_info("PMT        : program %d, version %d, PCR pid %d, %d streams\n",
+		prg->program, version, prg->pcr_pid, prg->num_es_pids);
+	demux_build_map(ts);
+}
+
+static void batch_add(struct output *out, uint8_t *pkt) {
+	if (out->batch_len + TS_PACKET_SIZE > out->batch_size) {
+		out->batch_size = out->batch_size ? out->batch_size * 2 : 64 * 1024;
+		out->batch = realloc(out->batch, out->batch_size);
+		if (!out->batch)
+			die("Can't alloc %d bytes.\n", out->batch_size);
+	}
+	memcpy(out->batch + out->batch_len, pkt, TS_PACKET_SIZE);
+	out->batch_len += TS_PACKET_SIZE;
+}
+
+void demux_init(struct ts *ts) {
+	struct demux *d = calloc(1, sizeof(struct demux));
+	if (!d)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct demux));
+	d->pat_version = -1;
+	ts->demux = d;
+
+	if (strcmp(ts->programs, "all") == 0) {
+		d->all = 1;
+		return;
+	}
+
+	char *list = strdup(ts->programs);
+	char *p, *saveptr = NULL;
+	for (p = strtok_r(list, ",", &saveptr); p; p = strtok_r(NULL, ",", &saveptr)) {
+		int program = atoi(p);
+		if (program < 1 || program > 65535)
+			die("Invalid program number: %s", p);
+		if (d->num_selected >= MAX_OUTPUTS)
+			die("Too many programs (max %d).", MAX_OUTPUTS);
+		d->selected[d->num_selected++] = program;
+	}
+	free(list);
+}
+
+void demux_free(struct ts *ts) {
+	free(ts->demux);
+	ts->demux = NULL;
+}
+
+/*
+ * Scatter the packets of the chunk into per program batches using
+ * the PID table and write each batch with one write().
+ */
+void demux_packet(struct ts *ts, struct packet *packet) {
+	struct demux *d = ts->demux;
+	int i, j;
+
+	for (i = 0; i + TS_PACKET_SIZE <= packet->data_len; i += TS_PACKET_SIZE) {
+		uint8_t *pkt = packet->data + i;
+		if (pkt[0] != 0x47)
+			continue;
+		int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+
+		if (pid == 0) {
+			int sec_len = psi_push(&d->pat, pkt);
+			if (sec_len)
+				demux_pat(ts, d->pat.data, sec_len);
+			// Replace PAT with single program PAT
+			for (j = 0; j < d->num_programs; j++) {
+				struct demux_program *prg = &d->programs[j];
+				if (prg->pmt_pid < 0 || !(pkt[1] & 0x40))
+					continue;
+				prg->pat[3] = 0x10 | prg->pat_cc;
+				prg->pat_cc = (prg->pat_cc + 1) & 0x0f;
+				batch_add(prg->out, prg->pat);
+			}
+			continue;
+		}
+
+		if (d->pid_flags[pid] & PID_IS_PMT) {
+			for (j = 0; j < d->num_programs; j++) {
+				struct demux_program *prg = &d->programs[j];
+				if (prg->pmt_pid != pid)
+					continue;
+				int sec_len = psi_push(&prg->pmt, pkt);
+				if (sec_len)
+					demux_pmt(ts, prg, prg->pmt.data, sec_len);
+			}
+		}
+
+		uint64_t mask = d->pid_map[pid];
+		while (mask) {
+			int idx = __builtin_ctzll(mask);
+			mask &= mask - 1;
+			batch_add(ts->outputs[idx], pkt);
+		}
+	}
+
+	for (i = 0; i < ts->num_outputs; i++) {
+		struct output *out = ts->outputs[i];
+		if (!out->batch_len)
+			continue;
+		if (ts->writer) {
+			writer_add(ts, out, packet); // Takes the batch
+			continue;
+		}
+		output_write(ts, out, packet->ts.tv_sec, packet->lost, out->batch, out->batch_len);
+		out->batch_len = 0;
+	}
+}
@@ -0,0 +1,197 @@
+/*
+ * Forward the received stream to other UDP/RTP destinations
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "tsdumper2.h"
+
+#define FANOUT_BATCH        32						// max datagrams per sendmmsg()
+#define FANOUT_REPORT_SECS  10
+
+/*
+ * The datagrams are not copied, the iovecs point into the packet that
+ * is filled for recording. The input loop collects the datagrams that
+ * are already waiting on the socket and sends them before it blocks
+ * again, nothing is held for the next datagram. The batch is also sent
+ * before the packet is given to write_thread, so the data is always
+ * valid. The sockets are non blocking, when a destination can't keep up
+ * its datagrams are dropped.
+ */
+struct fanout_dest {
+	struct io			*io;
+	uint16_t			rtp_seq;
+	unsigned long long	sent;
+	unsigned long long	dropped;
+	unsigned long long	last_dropped;
+	int					last_errno;
+};
+
+struct fanout {
+	int					num_dests;
+	struct fanout_dest	dest[FORWARD_MAX];
+	uint32_t			ssrc;
+
+	int					count;						// datagrams in the batch
+	struct iovec		data[FANOUT_BATCH];
+	struct iovec		iov[FANOUT_BATCH][2];		// RTP header + data
+	uint8_t				rtp_hdr[FANOUT_BATCH][RTP_HDR_SZ];
+	struct mmsghdr		msgs[FANOUT_BATCH];
+
+	time_t				last_report;
+};
+
+void fanout_init(struct ts *ts) {
+	struct fanout *f;
+	int i;
+
+	f = calloc(1, sizeof(struct fanout));
+	if (!f)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct fanout));
+	f->ssrc = time(NULL) ^ getpid();
+	f->last_report = time(NULL);
+	for (i = 0; i < ts->num_forward; i++) {
+		struct fanout_dest *d = &f->dest[f->num_dests++];
+		d->io = &ts->forward[i];
+		d->rtp_seq = rand();
+		if (udp_connect_output(d->io) < 0)
+			die("Can't connect to forward destination %s:%s", d->io->hostname, d->io->service);
+	}
+	ts->fanout = f;
+}
+
+void fanout_free(struct ts *ts) {
+	struct fanout *f = ts->fanout;
+	int i;
+	for (i = 0; i < f->num_dests; i++) {
+		if (f->dest[i].io->fd > -1)
+			close(f->dest[i].io->fd);
+		f->dest[i].io->fd = -1;
+	}
+	free(f);
+	ts->fanout = NULL;
+}
+
+static void fanout_rtp_header(uint8_t *hdr, uint16_t seq, uint32_t timestamp, uint32_t ssrc) {
+	hdr[0]  = 0x80;									// version 2
+	hdr[1]  = 33;									// MP2T
+	hdr[2]  = seq >> 8;
+	hdr[3]  = seq & 0xff;
+	hdr[4]  = timestamp >> 24;
+	hdr[5]  = timestamp >> 16;
+	hdr[6]  = timestamp >> 8;
+	hdr[7]  = timestamp;
+	hdr[8]  = ssrc >> 24;
+	hdr[9]  = ssrc >> 16;
+	hdr[10] = ssrc >> 8;
+	hdr[11] = ssrc;
+}
+
+static int fanout_send(int fd, struct mmsghdr *msgs, int count) {
+#ifdef __linux__
+	return sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+#else
+	int i;
+	for (i = 0; i < count; i++) {
+		if (sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT) < 0)
+			return i ? i : -1;
+	}
+	return count;
+#endif
+}
+
+void fanout_flush(struct ts *ts) {
+	struct fanout *f = ts->fanout;
+	struct timeval now;
+	int i, j;
+
+	if (!f->count)
+		return;
+
+	gettimeofday(&now, NULL);
+	uint32_t timestamp = now.tv_sec * 90000 + now.tv_usec * 9 / 100;
+
+	for (i = 0; i < f->num_dests; i++) {
+		struct fanout_dest *d = &f->dest[i];
+		int rtp = d->io->type == RTP;
+		for (j = 0; j < f->count; j++) {
+			struct msghdr *hdr = &f->msgs[j].msg_hdr;
+			memset(hdr, 0, sizeof(*hdr));
+			if (rtp) {
+				fanout_rtp_header(f->rtp_hdr[j], d->rtp_seq + j, timestamp, f->ssrc);
+				f->iov[j][0].iov_base = f->rtp_hdr[j];
+				f->iov[j][0].iov_len  = RTP_HDR_SZ;
+				f->iov[j][1] = f->data[j];
+				hdr->msg_iov    = f->iov[j];
+				hdr->msg_iovlen = 2;
+			} else {
+				hdr->msg_iov    = &f->data[j];
+				hdr->msg_iovlen = 1;
+			}
+		}
+		int sent = 0;
+		while (sent < f->count) {
+			int ret = fanout_send(d->io->fd, f->msgs + sent, f->count - sent);
+			if (ret <= 0) {
+				if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != d->last_errno) {
+					d->last_errno = errno;
+					p_err("Can't forward to %s:%s: %s", d->io->hostname, d->io->service, strerror(errno));
+				}
+				break;
+			}
+			sent += ret;
+		}
+		// The sequence counts the dropped datagrams too, so the probe sees the loss
+		d->rtp_seq += f->count;
+		d->sent    += sent;
+		d->dropped += f->count - sent;
+	}
+	f->count = 0;
+}
+
+// Called after the datagram is copied into the packet
+void fanout_add(struct ts *ts, uint8_t *data, ssize_t len) {
+	struct fanout *f = ts->fanout;
+
+	f->data[f->count].iov_base = data;
+	f->data[f->count].iov_len  = len;
+	if (++f->count == FANOUT_BATCH)
+		fanout_flush(ts);
+}
+
+void fanout_report(struct ts *ts, int force) {
+	struct fanout *f = ts->fanout;
+	time_t now = time(NULL);
+	int i;
+
+	if (!force && now - f->last_report < FANOUT_REPORT_SECS)
+		return;
+	f->last_report = now;
+	for (i = 0; i < f->num_dests; i++) {
+		struct fanout_dest *d = &f->dest[i];
+		if (!force && d->dropped == d->last_dropped)
+			continue;
+		p_info("Forward    : %s://%s:%s/ sent %llu, dropped %llu\n",
+			d->io->type == RTP ? "rtp" : "udp", d->io->hostname, d->io->service,
+			d->sent, d->dropped);
+		d->last_dropped = d->dropped;
+	}
+}
@@ -0,0 +1,351 @@
+/*
+ * SMPTE 2022-1 FEC recovery for RTP input
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "tsdumper2.h"
+
+// Media packets kept in the matrix (must be power of 2). SMPTE 2022-1
+// limits L*D to 100, so this holds two full matrices plus history.
+#define FEC_WINDOW      512
+#define FEC_MASK        (FEC_WINDOW - 1)
+
+// FEC packets waiting for more media to arrive
+#define FEC_PENDING     64
+
+// Largest media/FEC payload we can handle (multiple of FEC_ALIGN)
+#define FEC_DATA_MAX    1472
+#define FEC_HDR_SZ      16
+#define FEC_ALIGN       32
+
+#define FEC_REPORT_SECS 10
+
+// SMPTE 2022-1 limit of L*D, the delay before the matrix is known
+#define FEC_LD_MAX      100
+
+#define ALIGN_UP(__src, __value) (((__src) + (__value) - 1) & ~((__value) - 1))
+
+struct fec_slot {
+	uint8_t				data[FEC_DATA_MAX] __attribute__((aligned(FEC_ALIGN)));
+	int					len;						// 0 == slot is empty
+	uint16_t			seq;
+};
+
+struct fec_pkt {
+	uint8_t				data[FEC_DATA_MAX] __attribute__((aligned(FEC_ALIGN)));
+	int					len;						// 0 == slot is empty
+	uint16_t			snbase;
+	uint16_t			len_rec;
+	uint8_t				offset;
+	uint8_t				na;
+};
+
+struct fec {
+	struct fec_slot		media[FEC_WINDOW];
+	struct fec_pkt		pending[FEC_PENDING];
+	int					pending_pos;
+
+	int					started;
+	uint16_t			next_seq;					// next packet to give to process_packets()
+	uint16_t			last_seq;					// highest received sequence number
+	int					delay;						// how many packets to wait for recovery
+	int					matrix_known;				// L and D are known from column FEC
+
+	unsigned long long	media_packets;
+	unsigned long long	fec_packets;
+	unsigned long long	recovered;
+	unsigned long long	lost;
+	unsigned long long	dropped;
+
+	unsigned long long	last_recovered;
+	unsigned long long	last_lost;
+	time_t				last_report;
+};
+
+static void fec_xor(uint8_t *dst, const uint8_t *src, int len) {
+	int i = 0;
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_load_si256((__m256i *)(dst + i));
+		__m256i b = _mm256_load_si256((const __m256i *)(src + i));
+		_mm256_store_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+	}
+#elif defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_load_si128((__m128i *)(dst + i));
+		__m128i b = _mm_load_si128((const __m128i *)(src + i));
+		_mm_store_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+	}
+#endif
+	for (; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+// Copy payload and zero the tail so XOR can run over whole vectors.
+static void fec_copy(uint8_t *dst, const uint8_t *src, int len) {
+	memcpy(dst, src, len);
+	memset(dst + len, 0, ALIGN_UP(len, FEC_ALIGN) - len);
+}
+
+static struct fec_slot *fec_media(struct fec *f, uint16_t seq) {
+	struct fec_slot *s = &f->media[seq & FEC_MASK];
+	if (s->len && s->seq == seq)
+		return s;
+	return NULL;
+}
+
+static void fec_deliver(struct ts *ts, int force) {
+	struct fec *f = ts->fec;
+	while ((int16_t)(f->last_seq - f->next_seq) >= 0) {
+		struct fec_slot *s = fec_media(f, f->next_seq);
+		if (s) {
+			process_packets(ts, s->data, s->len);
+		} else {
+			if (!force && (uint16_t)(f->last_seq - f->next_seq) < f->delay)
+				break;
+			f->lost++;
+			ts->current_packet->lost++;
+		}
+		f->next_seq++;
+	}
+}
+
+static void fec_try_pending(struct ts *ts, uint16_t seq);
+
+// Returns 1 when the FEC packet is no longer needed.
+static int fec_try(struct ts *ts, struct fec_pkt *p) {
+	struct fec *f = ts->fec;
+	int i, nmissing = 0;
+	uint16_t seq, missing = 0;
+
+	for (i = 0; i < p->na; i++) {
+		seq = p->snbase + i * p->offset;
+		if (!fec_media(f, seq)) {
+			missing = seq;
+			if (++nmissing > 1)
+				return 0;
+		}
+	}
+	if (!nmissing)
+		return 1;
+	// Already given up on this one
+	if ((int16_t)(missing - f->next_seq) < 0)
+		return 1;
+	// Too far ahead, the slot is still used by undelivered packet
+	if ((uint16_t)(missing - f->next_seq) >= FEC_WINDOW / 2)
+		return 1;
+
+	struct fec_slot *r = &f->media[missing & FEC_MASK];
+	int len = p->len_rec;
+	r->len = 0;
+	memcpy(r->data, p->data, ALIGN_UP(p->len, FEC_ALIGN));
+	for (i = 0; i < p->na; i++) {
+		seq = p->snbase + i * p->offset;
+		if (seq == missing)
+			continue;
+		struct fec_slot *s = fec_media(f, seq);
+		if (s->len > p->len)
+			return 1;
+		fec_xor(r->data, s->data, ALIGN_UP(s->len, FEC_ALIGN));
+		len ^= s->len;
+	}
+	if (len <= 0 || len > p->len)
+		return 1;
+
+	r->seq = missing;
+	r->len = len;
+	f->recovered++;
+	// The lost packet was the newest one (row FEC came before next media)
+	if ((int16_t)(missing - f->last_seq) > 0)
+		f->last_seq = missing;
+	p_dbg1(" *** FEC recovered packet %u (len:%d) ***\n", missing, len);
+
+	fec_try_pending(ts, missing);
+	return 1;
+}
+
+// Retry waiting FEC packets that protect seq
+static void fec_try_pending(struct ts *ts, uint16_t seq) {
+	struct fec *f = ts->fec;
+	int i;
+	for (i = 0; i < FEC_PENDING; i++) {
+		struct fec_pkt *p = &f->pending[i];
+		if (!p->len)
+			continue;
+		uint16_t dist = seq - p->snbase;
+		if (dist % p->offset || dist / p->offset >= p->na)
+			continue;
+		if (fec_try(ts, p))
+			p->len = 0;
+	}
+}
+
+void fec_init(struct ts *ts) {
+	void *f;
+	if (posix_memalign(&f, 64, sizeof(struct fec)) != 0)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct fec));
+	memset(f, 0, sizeof(struct fec));
+	ts->fec = f;
+	ts->fec->delay = 2 * FEC_LD_MAX;
+}
+
+void fec_free(struct ts *ts) {
+	free(ts->fec);
+	ts->fec = NULL;
+}
+
+void fec_add_media(struct ts *ts, uint16_t seq, uint8_t *data, ssize_t len) {
+	struct fec *f = ts->fec;
+
+	if (len <= 0 || len > FEC_DATA_MAX) {
+		f->dropped++;
+		return;
+	}
+
+	if (!f->started) {
+		f->started  = 1;
+		f->next_seq = seq;
+		f->last_seq = seq;
+	}
+
+	int16_t dist = seq - f->next_seq;
+	if (dist < -FEC_WINDOW || dist >= FEC_WINDOW) { // Stream restart, flush everything
+		fec_deliver(ts, 1);
+		f->next_seq = seq;
+		f->last_seq = seq;
+	} else if (dist < 0 || fec_media(f, seq)) { // Late or duplicated
+		f->dropped++;
+		return;
+	} else if (dist >= FEC_WINDOW / 2) { // Make room in the matrix
+		while ((uint16_t)(seq - f->next_seq) >= FEC_WINDOW / 2) {
+			f->last_seq = f->next_seq;
+			fec_deliver(ts, 1);
+		}
+		f->last_seq = seq;
+	}
+
+	struct fec_slot *s = &f->media[seq & FEC_MASK];
+	fec_copy(s->data, data, len);
+	s->seq = seq;
+	s->len = len;
+	f->media_packets++;
+
+	if ((int16_t)(seq - f->last_seq) > 0)
+		f->last_seq = seq;
+
+	fec_try_pending(ts, seq);
+	fec_deliver(ts, 0);
+}
+
+static void fec_add_fec(struct ts *ts, uint8_t *buf, ssize_t len) {
+	struct fec *f = ts->fec;
+
+	if (len < RTP_HDR_SZ + FEC_HDR_SZ || (buf[0] >> 6) != 2)
+		goto DROP;
+
+	int hdr_len = RTP_HDR_SZ + (buf[0] & 0x0f) * 4;
+	if (buf[0] & 0x10) { // RTP header extension
+		if (len < hdr_len + 4)
+			goto DROP;
+		hdr_len += 4 + ((buf[hdr_len + 2] << 8) | buf[hdr_len + 3]) * 4;
+	}
+	if (len < hdr_len + FEC_HDR_SZ)
+		goto DROP;
+
+	uint8_t *fh = buf + hdr_len;
+	int data_len = len - hdr_len - FEC_HDR_SZ;
+	if (data_len <= 0 || data_len > FEC_DATA_MAX)
+		goto DROP;
+
+	struct fec_pkt *p = &f->pending[f->pending_pos];
+	p->snbase  = (fh[0] << 8) | fh[1];
+	p->len_rec = (fh[2] << 8) | fh[3];
+	p->offset  = fh[13];
+	p->na      = fh[14];
+	if (!p->offset || !p->na || p->offset * p->na > FEC_WINDOW / 4) {
+		p->len = 0;
+		goto DROP;
+	}
+	fec_copy(p->data, fh + FEC_HDR_SZ, data_len);
+	p->len = data_len;
+	f->fec_packets++;
+
+	// Wait long enough for the whole matrix and its column FEC. Until the
+	// first column FEC packet the largest allowed matrix is assumed.
+	int delay = 2 * p->offset * p->na;
+	if (p->offset > 1 && (!f->matrix_known || delay > f->delay)) {
+		f->matrix_known = 1;
+		f->delay = delay;
+		p_info("FEC: L:%d D:%d, recovery delay %d packets\n", p->offset, p->na, delay);
+	}
+
+	if (!f->started || fec_try(ts, p))
+		p->len = 0;
+	else
+		f->pending_pos = (f->pending_pos + 1) % FEC_PENDING;
+	fec_deliver(ts, 0);
+	return;
+
+DROP:
+	f->dropped++;
+}
+
+void fec_read(struct ts *ts) {
+	static uint8_t buf[RTP_HDR_SZ + 64 + FEC_HDR_SZ + FEC_DATA_MAX];
+	int i, n;
+	for (i = 0; i < 2; i++) {
+		if (ts->input.fec_fd[i] < 0)
+			continue;
+		for (n = 0; n < FEC_PENDING; n++) {
+			ssize_t readen = recv(ts->input.fec_fd[i], buf, sizeof(buf), MSG_DONTWAIT);
+			if (readen <= 0)
+				break;
+			fec_add_fec(ts, buf, readen);
+		}
+	}
+	fec_report(ts, 0);
+}
+
+void fec_flush(struct ts *ts) {
+	struct fec *f = ts->fec;
+	if (f->started)
+		fec_deliver(ts, 1);
+}
+
+void fec_report(struct ts *ts, int force) {
+	struct fec *f = ts->fec;
+	time_t now = time(NULL);
+	if (!force) {
+		if (now - f->last_report < FEC_REPORT_SECS)
+			return;
+		if (f->recovered == f->last_recovered && f->lost == f->last_lost)
+			return;
+	}
+	p_info("FEC: media %llu, fec %llu, recovered %llu (+%llu), lost %llu (+%llu), dropped %llu\n",
+		f->media_packets, f->fec_packets,
+		f->recovered, f->recovered - f->last_recovered,
+		f->lost, f->lost - f->last_lost,
+		f->dropped);
+	f->last_recovered = f->recovered;
+	f->last_lost      = f->lost;
+	f->last_report    = now;
+}
@@ -0,0 +1,278 @@
+/*
+ * Non blocking logger
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "tsdumper2.h"
+
+/*
+ * Every thread that logs gets its own ring of messages. The thread only
+ * formats the message into the ring, tsdump-log thread writes them to
+ * stdout/stderr. When the ring is full the message is dropped and
+ * counted, the logging thread never waits.
+ */
+#define LOG_RING_SIZE  256							// must be power of 2
+#define LOG_MSG_MAX    256
+#define LOG_DRAIN_MS   20
+#define LOG_EVENT_SECS 10
+
+struct log_msg {
+	struct timeval		tv;
+	int					err;						// goes to stderr
+	char				text[LOG_MSG_MAX];
+};
+
+struct log_ring {
+	struct log_ring		*next;
+	unsigned int		head;						// written by tsdump-log
+	unsigned int		tail;						// written by the owner thread
+	unsigned long		dropped;
+	struct log_msg		msgs[LOG_RING_SIZE];
+};
+
+// Repeated events are printed once and then summarized every LOG_EVENT_SECS
+struct log_event {
+	const char			*summary;					// "... %llu ... %lu events ... %d sec"
+	time_t				window_start;				// 0 == next event is printed
+	unsigned long		events;
+	unsigned long long	value;
+};
+
+static struct log_event log_events[LOG_EV_MAX] = {
+	[LOG_EV_RTP_DISCONT] = { " *** RTP discontinuity: lost %llu packets in %lu events in last %d sec ***\n", 0, 0, 0 },
+	[LOG_EV_READ_TIMEOUT] = { " *** Input read timeout: no input for %llu ms (%lu timeouts) in last %d sec ***\n", 0, 0, 0 },
+	[LOG_EV_WRITE_ERROR] = { " *** Write errors: %llu bytes not written in %lu events in last %d sec ***\n", 0, 0, 0 },
+};
+
+static struct log_ring *log_rings;					// all rings, newest first
+static __thread struct log_ring *my_ring;
+
+static int log_running;
+static int log_quit;
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; // one consumer at a time
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+static void log_print(struct timeval *tv, int err, const char *text) {
+	FILE *out = err ? stderr : stdout;
+	if (DEBUG > 0) {
+		char date[64];
+		struct tm tm;
+		localtime_r(&tv->tv_sec, &tm);
+		strftime(date, sizeof(date), "%F %H:%M:%S", &tm);
+		fprintf(out, "%08ld.%08ld %s | ", (long)tv->tv_sec, (long)tv->tv_usec, date);
+	}
+	fputs(text, out);
+}
+
+static struct log_ring *log_ring_get(void) {
+	if (my_ring)
+		return my_ring;
+	struct log_ring *r = calloc(1, sizeof(struct log_ring));
+	if (!r)
+		return NULL;
+	r->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	my_ring = r;
+	return r;
+}
+
+/*
+ * Write pending messages of all threads ordered by time. Must be called
+ * with log_lock held.
+ */
+static void log_drain(void) {
+	struct log_ring *r, *first;
+	int printed = 0;
+
+	while (1) {
+		struct log_msg *msg = NULL;
+		first = NULL;
+		for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+			if (r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+				continue;
+			struct log_msg *m = &r->msgs[r->head & (LOG_RING_SIZE - 1)];
+			if (!msg || timercmp(&m->tv, &msg->tv, <)) {
+				msg   = m;
+				first = r;
+			}
+		}
+		if (!first)
+			break;
+		log_print(&msg->tv, msg->err, msg->text);
+		__atomic_store_n(&first->head, first->head + 1, __ATOMIC_RELEASE);
+		printed++;
+	}
+
+	for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		unsigned long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			fprintf(stderr, "ERROR: Log buffer full, %lu messages are lost\n", dropped);
+			printed++;
+		}
+	}
+
+	if (printed) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+}
+
+static void log_events_report(time_t now, int force) {
+	struct timeval tv;
+	char text[LOG_MSG_MAX];
+	int i;
+
+	gettimeofday(&tv, NULL);
+	for (i = 0; i < LOG_EV_MAX; i++) {
+		struct log_event *ev = &log_events[i];
+		time_t start = __atomic_load_n(&ev->window_start, __ATOMIC_ACQUIRE);
+		if (!start || (!force && now - start < LOG_EVENT_SECS))
+			continue;
+		unsigned long events     = __atomic_exchange_n(&ev->events, 0, __ATOMIC_RELAXED);
+		unsigned long long value = __atomic_exchange_n(&ev->value, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ev->window_start, 0, __ATOMIC_RELEASE);
+		if (!events)
+			continue;
+		snprintf(text, sizeof(text), ev->summary, value, events, (int)(now - start));
+		log_print(&tv, 0, text);
+		fflush(stdout);
+	}
+}
+
+static void *log_thread_run(void *unused) {
+	struct timespec wait;
+	(void)unused;
+
+	set_thread_name("tsdump-log");
+
+	pthread_mutex_lock(&log_lock);
+	while (!log_quit) {
+		log_drain();
+		log_events_report(time(NULL), 0);
+		clock_gettime(CLOCK_REALTIME, &wait);
+		wait.tv_nsec += LOG_DRAIN_MS * 1000000;
+		wait.tv_sec  += wait.tv_nsec / 1000000000;
+		wait.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&log_cond, &log_lock, &wait);
+	}
+	log_drain();
+	log_events_report(time(NULL), 1);
+	pthread_mutex_unlock(&log_lock);
+	return NULL;
+}
+
+void log_init(struct ts *ts) {
+	log_quit = 0;
+	if (pthread_create(&log_thread, &ts->thread_attr, &log_thread_run, NULL) != 0)
+		return; // Messages are printed directly
+	__atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+	atexit(log_flush); // Do not lose the messages before exit(EXIT_FAILURE)
+}
+
+void log_free(void) {
+	if (!log_running)
+		return;
+	pthread_mutex_lock(&log_lock);
+	log_quit = 1;
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+	pthread_join(log_thread, NULL);
+	__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+
+	// All other threads are stopped at this point
+	struct log_ring *r = log_rings;
+	while (r) {
+		struct log_ring *next = r->next;
+		free(r);
+		r = next;
+	}
+	log_rings = NULL;
+	my_ring   = NULL;
+}
+
+// Print pending messages, used before exit()
+void log_flush(void) {
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&log_lock);
+	log_drain();
+	pthread_mutex_unlock(&log_lock);
+}
+
+void log_vwrite(int err, const char *fmt, va_list args) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	struct log_ring *r = NULL;
+	if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+		r = log_ring_get();
+
+	char *text, buf[LOG_MSG_MAX];
+	if (r) {
+		unsigned int tail = r->tail;
+		if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+			__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		struct log_msg *msg = &r->msgs[tail & (LOG_RING_SIZE - 1)];
+		msg->tv  = tv;
+		msg->err = err;
+		text = msg->text;
+	} else {
+		text = buf;
+	}
+
+	int len = 0;
+	if (err)
+		len = snprintf(text, LOG_MSG_MAX, "ERROR: ");
+	len += vsnprintf(text + len, LOG_MSG_MAX - len, fmt, args);
+	if (len > LOG_MSG_MAX - 2)
+		len = LOG_MSG_MAX - 2;
+	if (len > 0 && text[len - 1] != '\n') {
+		text[len++] = '\n';
+		text[len] = '\0';
+	}
+
+	if (r) {
+		__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+	} else {
+		log_print(&tv, err, text);
+		fflush(err ? stderr : stdout);
+	}
+}
+
+/*
+ * Count repeated event. Returns 1 when the caller should print its message
+ * (the first event in LOG_EVENT_SECS), the rest of the events are only
+ * counted and tsdump-log prints their summary.
+ */
+int log_event(enum log_event_type type, unsigned long long value) {
+	struct log_event *ev = &log_events[type];
+	time_t start = 0;
+
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+		return 1;
+	if (__atomic_compare_exchange_n(&ev->window_start, &start, time(NULL), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return 1;
+	__atomic_fetch_add(&ev->events, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ev->value, value, __ATOMIC_RELAXED);
+	return 0;
+}
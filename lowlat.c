@@ -0,0 +1,185 @@
+/*
+ * Low latency input (busy polling) and latency statistics
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "tsdumper2.h"
+
+#ifdef __linux__
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#endif
+
+#define BUSY_POLL_USEC      50						// SO_BUSY_POLL time per recv()
+#define LOWLAT_REPORT_SECS  10
+
+/*
+ * In busy poll mode the input thread is pinned to one CPU and never
+ * sleeps. It spins on non blocking recv() and the kernel polls the NIC
+ * queue directly (SO_BUSY_POLL) instead of waiting for the interrupt.
+ * While there is no input the chunk is handed to write_thread as soon as
+ * it is older than the latency budget.
+ *
+ * The latency of every written chunk is measured from the arrival of its
+ * first (oldest) datagram until write() returns.
+ */
+struct lowlat {
+	unsigned long long	reads;
+	unsigned long long	empty_polls;
+
+	// Updated by the threads that write the files
+	pthread_mutex_t		lock;
+	time_t				last_report;
+	unsigned long		chunks;
+	unsigned long long	total_usec;
+	unsigned long long	max_usec;
+	unsigned long		all_chunks;
+	unsigned long long	all_total_usec;
+	unsigned long long	all_max_usec;
+};
+
+void lowlat_init(struct ts *ts) {
+	struct lowlat *l = calloc(1, sizeof(struct lowlat));
+	if (!l)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct lowlat));
+	pthread_mutex_init(&l->lock, NULL);
+	l->last_report = time(NULL);
+	ts->lowlat = l;
+}
+
+void lowlat_free(struct ts *ts) {
+	struct lowlat *l = ts->lowlat;
+
+	if (ts->busy_poll)
+		p_info("Busy poll  : %llu reads, %llu empty polls\n", l->reads, l->empty_polls);
+	l->all_chunks     += l->chunks;
+	l->all_total_usec += l->total_usec;
+	if (l->max_usec > l->all_max_usec)
+		l->all_max_usec = l->max_usec;
+	if (l->all_chunks)
+		p_info("Latency    : arrival to write avg %lluus, max %lluus (%lu chunks)\n",
+			l->all_total_usec / l->all_chunks, l->all_max_usec, l->all_chunks);
+
+	pthread_mutex_destroy(&l->lock);
+	free(l);
+	ts->lowlat = NULL;
+}
+
+static void busy_poll_socket(int fd) {
+#ifdef __linux__
+	int usec = BUSY_POLL_USEC, on = 1;
+	if (fd < 0)
+		return;
+	// Values above net.core.busy_read need CAP_NET_ADMIN
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+		p_err("setsockopt(SO_BUSY_POLL): %s", strerror(errno));
+	// Linux 5.11+, keeps the NIC interrupts masked while we poll
+	if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0)
+		p_info("Busy poll  : SO_PREFER_BUSY_POLL is not supported (%s)\n", strerror(errno));
+#else
+	(void)fd;
+#endif
+}
+
+/*
+ * Called by the input thread after the other threads are started, so
+ * they do not inherit the CPU affinity.
+ */
+void lowlat_start(struct ts *ts) {
+	if (!ts->busy_poll)
+		return;
+	busy_poll_socket(ts->input.fd);
+	busy_poll_socket(ts->input2.fd);
+#ifdef __linux__
+	cpu_set_t cpus;
+	if (ts->busy_poll_cpu >= CPU_SETSIZE) {
+		p_err("Can't pin input thread to CPU %d", ts->busy_poll_cpu);
+		return;
+	}
+	CPU_ZERO(&cpus);
+	CPU_SET(ts->busy_poll_cpu, &cpus);
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret)
+		p_err("Can't pin input thread to CPU %d: %s", ts->busy_poll_cpu, strerror(ret));
+	else
+		p_info("Busy poll  : input thread is running on CPU %d\n", ts->busy_poll_cpu);
+#endif
+}
+
+// Spin until a datagram is received, returns -1 after timeout ms without input
+ssize_t lowlat_read(struct ts *ts, uint8_t *buf, size_t buf_size, int timeout) {
+	struct lowlat *l = ts->lowlat;
+	struct timeval start, now;
+
+	gettimeofday(&start, NULL);
+	while (1) {
+		ssize_t readen;
+		if (ts->merge)
+			readen = merge_read(ts, buf, buf_size, 0);
+		else
+			readen = recv(ts->input.fd, buf, buf_size, MSG_DONTWAIT);
+		if (readen >= 0) {
+			l->reads++;
+			return readen;
+		}
+		l->empty_polls++;
+		if (ts->fanout)
+			fanout_flush(ts);
+		gettimeofday(&now, NULL);
+		process_flush(ts, &now);
+		if (timeval_diff_msec(&start, &now) >= (unsigned long long)timeout)
+			return -1;
+	}
+}
+
+// Called after the chunk that started at arrival is written
+void lowlat_written(struct ts *ts, struct timeval *arrival) {
+	struct lowlat *l = ts->lowlat;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	long long usec = (now.tv_sec - arrival->tv_sec) * 1000000LL + (now.tv_usec - arrival->tv_usec);
+	if (usec < 0) // Clock jump
+		usec = 0;
+
+	pthread_mutex_lock(&l->lock);
+	l->chunks++;
+	l->total_usec += usec;
+	if ((unsigned long long)usec > l->max_usec)
+		l->max_usec = usec;
+	if (now.tv_sec - l->last_report >= LOWLAT_REPORT_SECS) {
+		p_info("Latency    : arrival to write avg %lluus, max %lluus (%lu chunks) in last %d sec\n",
+			l->total_usec / l->chunks, l->max_usec, l->chunks, (int)(now.tv_sec - l->last_report));
+		l->all_chunks     += l->chunks;
+		l->all_total_usec += l->total_usec;
+		if (l->max_usec > l->all_max_usec)
+			l->all_max_usec = l->max_usec;
+		l->chunks      = 0;
+		l->total_usec  = 0;
+		l->max_usec    = 0;
+		l->last_report = now.tv_sec;
+	}
+	pthread_mutex_unlock(&l->lock);
+}
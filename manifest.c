@@ -0,0 +1,261 @@
+/*
+ * CRC32C checksums and per file manifest
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "tsdumper2.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#endif
+
+#define MANIFEST_READ_SIZE (1024 * 1024)
+
+/*
+ * CRC32C (Castagnoli) is calculated over the data while it is written,
+ * so the checksum of the file is known without reading it again. The
+ * SSE4.2 crc32 instruction is used when the CPU has it, otherwise
+ * slicing-by-8 tables are used.
+ */
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void) {
+	uint32_t i, j, crc;
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : (crc >> 1);
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t len) {
+	while (len && ((uintptr_t)data & 7)) {
+		crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, data, 8);
+		v ^= crc; // Little endian
+		crc = crc32c_table[7][ v        & 0xff] ^ crc32c_table[6][(v >>  8) & 0xff] ^
+		      crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+		      crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+		      crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][ v >> 56];
+		data += 8;
+		len  -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+	uint64_t crc64 = crc;
+	while (len && ((uintptr_t)data & 7)) {
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, data, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+		data += 8;
+		len  -= 8;
+	}
+	while (len--)
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+	return (uint32_t)crc64;
+}
+#endif
+
+static uint32_t (*crc32c_func)(uint32_t crc, const uint8_t *data, size_t len);
+
+void crc32c_init(void) {
+#ifdef HAVE_CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_func = crc32c_sse42;
+		return;
+	}
+#endif
+	crc32c_init_table();
+	crc32c_func = crc32c_sw;
+}
+
+// Start with crc 0 and pass the result of the previous call
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len) {
+	return ~crc32c_func(~crc, data, len);
+}
+
+// Update the checksums and the counters of the file with the written data
+void manifest_update(struct output *out, struct output_file *o, uint8_t *data, int data_len) {
+	o->crc32c     = crc32c(o->crc32c, data, data_len);
+	o->cc_errors += cc_scan(out->cc, data, data_len);
+}
+
+/*
+ * Load the state saved in NAME.manifest while the file was written.
+ * Returns the size of the data it covers or -1 if it can't be used.
+ */
+static off_t manifest_load(struct output_file *o, const char *path) {
+	char name[PATH_MAX], line[256];
+	unsigned long long size = 0;
+	int have_size = 0, have_crc = 0;
+	uint32_t crc = 0;
+	unsigned long cc_errors = 0, input_lost = 0;
+	struct pcr_info pcr;
+
+	snprintf(name, sizeof(name), "%s.manifest", path);
+	FILE *f = fopen(name, "r");
+	if (!f)
+		return -1;
+	pcr_reset(&pcr);
+	while (fgets(line, sizeof(line), f)) {
+		char *val = strchr(line, '=');
+		if (!val)
+			continue;
+		*val++ = '\0';
+		unsigned long long v = strtoull(val, NULL, 10);
+		if (strcmp(line, "size") == 0) {
+			size = v;
+			have_size = 1;
+		} else if (strcmp(line, "crc32c") == 0) {
+			crc = strtoul(val, NULL, 16);
+			have_crc = 1;
+		} else if (strcmp(line, "pcr_pid") == 0) {
+			pcr.pid = v;
+		} else if (strcmp(line, "pcr_count") == 0) {
+			pcr.count = v;
+		} else if (strcmp(line, "pcr_first") == 0) {
+			pcr.first = v;
+		} else if (strcmp(line, "pcr_last") == 0) {
+			pcr.last = v;
+		} else if (strcmp(line, "pcr_first_pos") == 0) {
+			pcr.first_pos = v;
+		} else if (strcmp(line, "pcr_last_pos") == 0) {
+			pcr.last_pos = v;
+		} else if (strcmp(line, "cc_errors") == 0) {
+			cc_errors = v;
+		} else if (strcmp(line, "input_lost") == 0) {
+			input_lost = v;
+		}
+	}
+	fclose(f);
+	// The data after the last save may be lost or cut by the recovery
+	if (!have_size || !have_crc || (off_t)size > o->size)
+		return -1;
+	o->crc32c     = crc;
+	o->pcr        = pcr;
+	o->cc_errors  = cc_errors;
+	o->input_lost = input_lost;
+	return size;
+}
+
+/*
+ * The file is appended after restart, continue from the state saved in
+ * the manifest and read only the data written after it. Without usable
+ * manifest the whole file is read. Returns the number of bytes read.
+ */
+off_t manifest_resume(struct output *out, struct output_file *o, const char *path) {
+	off_t pos = manifest_load(o, path);
+	ssize_t len;
+
+	if (pos < 0) {
+		pos = 0;
+		o->crc32c     = 0;
+		o->cc_errors  = 0;
+		o->input_lost = 0;
+		pcr_reset(&o->pcr);
+	}
+	off_t start = pos;
+	uint8_t *buf = malloc(MANIFEST_READ_SIZE);
+	if (!buf)
+		return 0;
+	while (pos < o->size && (len = pread(o->fd, buf, MANIFEST_READ_SIZE, pos)) > 0) {
+		if (len > o->size - pos)
+			len = o->size - pos;
+		pcr_scan(&o->pcr, buf, len, pos);
+		manifest_update(out, o, buf, len);
+		pos += len;
+	}
+	free(buf);
+	return pos - start;
+}
+
+/*
+ * Write NAME.manifest next to the file path. It is also saved every
+ * MANIFEST_SAVE_SECS by tsdump-rotate while the file is written
+ * (complete=0), so the state can be restored after restart.
+ */
+void manifest_write(struct output_file *o, const char *path, int complete) {
+	char name[PATH_MAX], tmp_name[PATH_MAX + 8], text[1024];
+	double duration = pcr_duration(&o->pcr, o->size);
+	int len;
+
+	snprintf(name, sizeof(name), "%s.manifest", path);
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+	len = snprintf(text, sizeof(text),
+		"file=%s\n"
+		"start=%ld\n"
+		"size=%llu\n"
+		"crc32c=%08x\n",
+		o->filename, (long)o->startts, (unsigned long long)o->size, o->crc32c);
+	if (o->pcr.count)
+		len += snprintf(text + len, sizeof(text) - len,
+			"pcr_pid=%d\n"
+			"pcr_first=%llu\n"
+			"pcr_last=%llu\n"
+			"duration=%.3f\n"
+			"pcr_count=%d\n"
+			"pcr_first_pos=%llu\n"
+			"pcr_last_pos=%llu\n",
+			o->pcr.pid, (unsigned long long)o->pcr.first, (unsigned long long)o->pcr.last, duration,
+			o->pcr.count, (unsigned long long)o->pcr.first_pos, (unsigned long long)o->pcr.last_pos);
+	len += snprintf(text + len, sizeof(text) - len,
+		"cc_errors=%lu\n"
+		"input_lost=%lu\n"
+		"complete=%d\n",
+		o->cc_errors, o->input_lost, complete);
+
+	int fd = open(tmp_name, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		p_err("Can't create manifest %s", tmp_name);
+		return;
+	}
+	ssize_t written = write(fd, text, len);
+	close(fd);
+	if (written != len) {
+		p_err("Can not write manifest (written %zd of %d file:%s)", written, len, tmp_name);
+		unlink(tmp_name);
+		return;
+	}
+	if (rename(tmp_name, name) < 0)
+		p_err("Can't rename %s to %s", tmp_name, name);
+}
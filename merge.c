@@ -0,0 +1,311 @@
+/*
+ * Seamless merge of two redundant RTP inputs (SMPTE 2022-7 style)
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "tsdumper2.h"
+
+// Sequence numbers remembered for duplicate detection (must be power of 2)
+#define MERGE_WINDOW       4096
+#define MERGE_MASK         (MERGE_WINDOW - 1)
+
+// Packets held for reordering (must be power of 2)
+#define MERGE_HOLD         256
+#define MERGE_HOLD_MASK    (MERGE_HOLD - 1)
+#define MERGE_HOLD_MIN     8						// packets to wait for the missing one
+#define MERGE_HOLD_MSEC    100						// wait for the missing one when the input stops
+#define MERGE_DATA_MAX     1500
+
+#define MERGE_REPORT_SECS  10
+
+enum { MERGE_DROP, MERGE_KEEP, MERGE_RESTART };
+
+/*
+ * The legs can be several packets apart, so a packet that is lost on the
+ * leading leg arrives later from the lagging one. The packets are held
+ * in a window and given out in sequence order. A missing packet is
+ * waited for until the newest packet is more than the skew between the
+ * legs ahead (or MERGE_HOLD_MSEC when the input stops). The copies that
+ * arrive after that are counted as late and are not written.
+ */
+struct merge_slot {
+	uint8_t				data[MERGE_DATA_MAX];
+	int					len;						// 0 == slot is empty
+	uint16_t			seq;
+};
+
+struct merge_leg {
+	int					started;
+	uint16_t			last_seq;
+	unsigned long long	packets;					// received on this leg
+	unsigned long long	used;						// arrived first and were written
+	unsigned long long	lost;						// sequence gaps on this leg
+};
+
+struct merge {
+	uint32_t			seen[MERGE_WINDOW / 32];	// one bit per sequence number
+	int					started;
+	uint16_t			last_seq;					// highest sequence number seen
+	uint16_t			next_seq;					// next packet to give out
+	int					next_leg;					// read this leg first
+
+	struct merge_slot	slots[MERGE_HOLD];
+	int					held;						// packets in slots
+	struct merge_slot	restart;					// first packet after stream restart
+	int					skew;						// how far behind the lagging leg is
+	unsigned long long	gap_since;					// msec when the missing packet was first waited for
+
+	struct merge_leg	leg[2];
+	unsigned long long	duplicates;
+	unsigned long long	late;
+	unsigned long long	lost;						// lost on both legs
+
+	unsigned long long	last_lost[3];
+	time_t				last_report;
+};
+
+static unsigned long long now_msec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void merge_clear(struct merge *m, uint16_t from, uint16_t to) {
+	// Forget sequence numbers (from, to] so they can be reused after wrap
+	if ((uint16_t)(to - from) >= MERGE_WINDOW) {
+		memset(m->seen, 0, sizeof(m->seen));
+		return;
+	}
+	while (from != to) {
+		from++;
+		if ((from & 31) == 0 && (uint16_t)(to - from) >= 32) {
+			m->seen[(from & MERGE_MASK) / 32] = 0;
+			from += 31;
+			continue;
+		}
+		m->seen[(from & MERGE_MASK) / 32] &= ~(1u << (from & 31));
+	}
+}
+
+// Returns MERGE_KEEP if the packet is the first copy of seq and must be held.
+static int merge_packet(struct merge *m, int leg_num, uint16_t seq) {
+	struct merge_leg *leg = &m->leg[leg_num];
+
+	leg->packets++;
+	if (leg->started && (int16_t)(seq - leg->last_seq) > 0) {
+		leg->lost += (uint16_t)(seq - leg->last_seq) - 1;
+		leg->last_seq = seq;
+	} else if (!leg->started) {
+		leg->started  = 1;
+		leg->last_seq = seq;
+	}
+
+	if (!m->started) {
+		m->started  = 1;
+		m->last_seq = seq - 1;
+		m->next_seq = seq;
+	}
+
+	int16_t dist = seq - m->next_seq;
+	if (dist <= -MERGE_WINDOW || dist >= MERGE_HOLD) {
+		leg->used++;
+		return MERGE_RESTART;
+	}
+
+	int16_t lag = m->last_seq - seq;
+	if (lag < 0) {
+		merge_clear(m, m->last_seq, seq);
+		m->last_seq = seq;
+	} else if (lag >= m->skew && lag < MERGE_HOLD / 2) { // Copy from the lagging leg
+		m->skew = lag + 1;
+	}
+
+	uint32_t *word = &m->seen[(seq & MERGE_MASK) / 32];
+	uint32_t bit = 1u << (seq & 31);
+	if (*word & bit) {
+		m->duplicates++;
+		return MERGE_DROP;
+	}
+	*word |= bit;
+	if (dist < 0) { // The packet was already given up
+		m->late++;
+		return MERGE_DROP;
+	}
+
+	leg->used++;
+	return MERGE_KEEP;
+}
+
+static void merge_hold(struct merge_slot *s, uint16_t seq, uint8_t *buf, ssize_t len) {
+	memcpy(s->data, buf, len);
+	s->len = len;
+	s->seq = seq;
+}
+
+// The missing packet is not waited for anymore
+static void merge_skip(struct ts *ts, int lost) {
+	struct merge *m = ts->merge;
+	m->next_seq++;
+	if (!lost)
+		return;
+	m->lost++;
+	if (!ts->fec) // FEC counts the losses itself
+		ts->current_packet->lost++;
+}
+
+/*
+ * Copy the next packet in sequence order into buf. Returns its length
+ * or 0 if the missing packet is still waited for.
+ */
+static ssize_t merge_release(struct ts *ts, uint8_t *buf, size_t buf_size, int force) {
+	struct merge *m = ts->merge;
+
+	while (m->held) {
+		struct merge_slot *s = &m->slots[m->next_seq & MERGE_HOLD_MASK];
+		if (s->len && s->seq == m->next_seq) {
+			ssize_t len = (size_t)s->len < buf_size ? (size_t)s->len : buf_size;
+			memcpy(buf, s->data, len);
+			s->len = 0;
+			m->held--;
+			m->next_seq++;
+			m->gap_since = 0;
+			return len;
+		}
+		// The skew is not known until both legs are received
+		int hold = m->skew > MERGE_HOLD_MIN ? m->skew : MERGE_HOLD_MIN;
+		if (!m->leg[0].started || !m->leg[1].started)
+			hold = MERGE_HOLD / 2;
+		unsigned long long now = now_msec();
+		if (!m->gap_since)
+			m->gap_since = now;
+		if (!force && !m->restart.len && (uint16_t)(m->last_seq - m->next_seq) < hold &&
+		    now - m->gap_since < MERGE_HOLD_MSEC)
+			return 0;
+		merge_skip(ts, !m->restart.len);
+	}
+	m->gap_since = 0;
+
+	if (m->restart.len) { // Everything before the restart is given out, start again
+		struct merge_slot *r = &m->restart;
+		int16_t gap = r->seq - m->next_seq;
+		for (; gap > 0 && gap < MERGE_WINDOW; gap--) // Big gap on both legs
+			merge_skip(ts, 1);
+		memset(m->seen, 0, sizeof(m->seen));
+		m->seen[(r->seq & MERGE_MASK) / 32] |= 1u << (r->seq & 31);
+		m->last_seq = r->seq;
+		m->next_seq = r->seq;
+		merge_hold(&m->slots[r->seq & MERGE_HOLD_MASK], r->seq, r->data, r->len);
+		m->held++;
+		r->len = 0;
+		return merge_release(ts, buf, buf_size, force);
+	}
+	return 0;
+}
+
+void merge_init(struct ts *ts) {
+	ts->merge = calloc(1, sizeof(struct merge));
+	if (!ts->merge)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct merge));
+}
+
+void merge_free(struct ts *ts) {
+	free(ts->merge);
+	ts->merge = NULL;
+}
+
+/*
+ * Wait up to timeout msec for a packet on any of the inputs. Returns
+ * the packet length, 0 if there is no packet to give out yet and -1 on
+ * timeout.
+ */
+ssize_t merge_read(struct ts *ts, uint8_t *buf, size_t buf_size, int timeout) {
+	struct merge *m = ts->merge;
+	struct pollfd fds[2];
+	ssize_t len;
+	int i;
+
+	len = merge_release(ts, buf, buf_size, 0);
+	if (len)
+		return len;
+
+	// Do not wait for the input longer than for the missing packet
+	if (m->gap_since) {
+		long long left = MERGE_HOLD_MSEC - (long long)(now_msec() - m->gap_since);
+		if (left < timeout)
+			timeout = left > 0 ? left : 0;
+	}
+
+	// Nothing is waiting, send the forwarded datagrams before blocking
+	if (ts->fanout && timeout)
+		fanout_flush(ts);
+
+	fds[0].fd = ts->input.fd;
+	fds[1].fd = ts->input2.fd;
+	fds[0].events = fds[1].events = POLLIN;
+	fds[0].revents = fds[1].revents = 0;
+
+	if (poll(fds, 2, timeout) <= 0) {
+		len = merge_release(ts, buf, buf_size, 0);
+		return len ? len : -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		int leg_num = (m->next_leg + i) & 1;
+		if (!(fds[leg_num].revents & POLLIN))
+			continue;
+		ssize_t readen = recv(fds[leg_num].fd, buf, buf_size, MSG_DONTWAIT);
+		if (readen <= RTP_HDR_SZ || readen > MERGE_DATA_MAX)
+			continue;
+		m->next_leg = !leg_num;
+		uint16_t seq = (buf[2] << 8) | buf[3];
+		switch (merge_packet(m, leg_num, seq)) {
+		case MERGE_KEEP:
+			merge_hold(&m->slots[seq & MERGE_HOLD_MASK], seq, buf, readen);
+			m->held++;
+			break;
+		case MERGE_RESTART:
+			merge_hold(&m->restart, seq, buf, readen);
+			break;
+		}
+		return merge_release(ts, buf, buf_size, 0);
+	}
+
+	return 0;
+}
+
+void merge_report(struct ts *ts, int force) {
+	struct merge *m = ts->merge;
+	time_t now = time(NULL);
+	if (!force) {
+		if (now - m->last_report < MERGE_REPORT_SECS)
+			return;
+		if (m->leg[0].lost == m->last_lost[0] &&
+		    m->leg[1].lost == m->last_lost[1] &&
+		    m->lost == m->last_lost[2])
+			return;
+	}
+	p_info("Merge: leg1 %llu packets (used %llu, lost %llu), leg2 %llu packets (used %llu, lost %llu), duplicates %llu, late %llu, lost on both %llu, reorder window %d\n",
+		m->leg[0].packets, m->leg[0].used, m->leg[0].lost,
+		m->leg[1].packets, m->leg[1].used, m->leg[1].lost,
+		m->duplicates, m->late, m->lost, m->skew > MERGE_HOLD_MIN ? m->skew : MERGE_HOLD_MIN);
+	m->last_lost[0] = m->leg[0].lost;
+	m->last_lost[1] = m->leg[1].lost;
+	m->last_lost[2] = m->lost;
+	m->last_report  = now;
+}
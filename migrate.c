@@ -0,0 +1,370 @@
+/*
+ * Move closed files from staging directory to the archive
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "tsdumper2.h"
+
+#define MIGRATE_CHUNK      (1024 * 1024)
+#define MIGRATE_RETRY_MAX  60						// seconds between retries
+
+/*
+ * Files are recorded into the output (staging) directory. When a file is
+ * closed it is given to tsdump-migrate thread which copies it into the
+ * archive directory as NAME.part, renames it to NAME and removes the
+ * staging copy. The slow archive never blocks the writer.
+ *
+ * At exit the file of the current interval is left in staging, so the
+ * restarted program can append to it. Files that are left in staging
+ * from previous runs are moved when the program is started.
+ */
+struct migrate {
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int					quit;
+	mode_t				dir_perm;
+
+	struct output_file	*queue;						// files to move (FIFO)
+	unsigned int		queued;
+
+	unsigned long		files;
+	unsigned long long	bytes;
+	unsigned long		retries;
+	unsigned long		failed;
+	unsigned long long	max_msec;					// slowest file
+};
+
+static void migrate_wait(struct migrate *m, long msec) {
+	struct timespec wait;
+	clock_gettime(CLOCK_REALTIME, &wait);
+	wait.tv_sec  += msec / 1000;
+	wait.tv_nsec += (msec % 1000) * 1000000;
+	wait.tv_sec  += wait.tv_nsec / 1000000000;
+	wait.tv_nsec %= 1000000000;
+	pthread_mutex_lock(&m->lock);
+	if (!m->quit)
+		pthread_cond_timedwait(&m->cond, &m->lock, &wait);
+	pthread_mutex_unlock(&m->lock);
+}
+
+static unsigned long long now_msec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static ssize_t copy_chunk(int src_fd, int dst_fd, size_t len, char **buf) {
+#ifdef __linux__
+	static int use_copy_file_range = 1;
+	if (use_copy_file_range) {
+		ssize_t ret = copy_file_range(src_fd, NULL, dst_fd, NULL, len, 0);
+		if (ret >= 0)
+			return ret;
+		// Old kernel or copy between different file systems
+		if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+			return ret;
+		use_copy_file_range = 0;
+	}
+#endif
+	if (!*buf) {
+		*buf = malloc(MIGRATE_CHUNK);
+		if (!*buf)
+			return -1;
+	}
+	if (len > MIGRATE_CHUNK)
+		len = MIGRATE_CHUNK;
+	ssize_t readen = read(src_fd, *buf, len);
+	if (readen <= 0)
+		return readen;
+	ssize_t written = write(dst_fd, *buf, readen);
+	if (written != readen)
+		return -1;
+	return written;
+}
+
+static int migrate_file(struct ts *ts, struct output_file *o, int limit) {
+	struct migrate *m = ts->migrate;
+	char *src = ts->create_dirs ? o->full_filename : o->filename;
+	char dst[PATH_MAX], tmp[PATH_MAX + 8];
+	char *buf = NULL;
+	int src_fd = -1, dst_fd = -1;
+	off_t copied = 0;
+	unsigned long long start = now_msec();
+
+	if (ts->create_dirs) {
+		snprintf(dst, sizeof(dst), "%s/%s", ts->archive_dir, o->dirname);
+		if (create_dir(dst, m->dir_perm) < 0 && errno != EEXIST) {
+			p_err("Can't create directory %s: %s", dst, strerror(errno));
+			return -1;
+		}
+	}
+	snprintf(dst, sizeof(dst), "%s/%s", ts->archive_dir, src);
+	snprintf(tmp, sizeof(tmp), "%s.part", dst);
+
+	src_fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (src_fd < 0) {
+		p_err("Can't open %s: %s", src, strerror(errno));
+		goto ERR;
+	}
+	dst_fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+	if (dst_fd < 0) {
+		p_err("Can't create %s: %s", tmp, strerror(errno));
+		goto ERR;
+	}
+
+	while (1) {
+		ssize_t len = copy_chunk(src_fd, dst_fd, MIGRATE_CHUNK, &buf);
+		if (len < 0) {
+			p_err("Can't copy %s to %s: %s", src, tmp, strerror(errno));
+			goto ERR;
+		}
+		if (len == 0)
+			break;
+		copied += len;
+		// Sleep until the average rate is below the limit
+		if (limit && ts->archive_rate) {
+			unsigned long long due = copied * 1000ULL / ts->archive_rate;
+			unsigned long long elapsed = now_msec() - start;
+			if (due > elapsed)
+				migrate_wait(m, due - elapsed);
+		}
+	}
+	if (fsync(dst_fd) < 0) {
+		p_err("Can't sync %s: %s", tmp, strerror(errno));
+		goto ERR;
+	}
+	close(dst_fd);
+	dst_fd = -1;
+	close(src_fd);
+	src_fd = -1;
+
+	if (rename(tmp, dst) < 0) {
+		p_err("Can't rename %s to %s: %s", tmp, dst, strerror(errno));
+		goto ERR;
+	}
+	if (unlink(src) < 0)
+		p_err("Can't remove %s: %s", src, strerror(errno));
+
+	unsigned long long msec = now_msec() - start;
+	p_info(" > Move file %s to %s (%llu bytes, %llums)\n", src, ts->archive_dir,
+		(unsigned long long)copied, msec);
+	m->files++;
+	m->bytes += copied;
+	if (msec > m->max_msec)
+		m->max_msec = msec;
+	free(buf);
+	return 0;
+
+ERR:
+	if (dst_fd > -1) {
+		close(dst_fd);
+		unlink(tmp);
+	}
+	if (src_fd > -1)
+		close(src_fd);
+	free(buf);
+	return -1;
+}
+
+// The file is in the archive (or it is left in staging)
+static void migrate_done(struct ts *ts, struct output_file *o, int archived) {
+	char name[PATH_MAX];
+	char *path = ts->create_dirs ? o->full_filename : o->filename;
+	char *manifest_path = path;
+	if (archived) {
+		if (ts->retention)
+			retention_add(ts, o->out, o->startts, o->size);
+		if (ts->manifest) { // Saved state of the file in staging
+			snprintf(name, sizeof(name), "%s.manifest", path);
+			unlink(name);
+		}
+		if (ts->create_dirs) { // Remove empty YYYY/MM/DD/HH directories
+			int i;
+			snprintf(name, sizeof(name), "%s", path);
+			for (i = 0; i < 4; i++) {
+				char *p = strrchr(name, '/');
+				if (!p)
+					break;
+				*p = '\0';
+				if (rmdir(name) < 0)
+					break;
+			}
+		}
+		snprintf(name, sizeof(name), "%s/%s", ts->archive_dir, path);
+		manifest_path = name;
+	}
+	if (ts->manifest)
+		manifest_write(o, manifest_path, 1);
+	// The playlist is in the archive directory, the URI is relative to it
+	if (o->out->playlist && archived)
+		playlist_add(o->out, path, &o->pcr, o->size, ts->rotate_secs);
+	if (o->out->index < 0) // File left by previous run
+		free(o->out);
+	free(o);
+}
+
+static void *migrate_thread(void *_ts) {
+	struct ts *ts = _ts;
+	struct migrate *m = ts->migrate;
+	int retry = 0;
+
+	set_thread_name("tsdump-migrate");
+	set_thread_low_prio();
+
+	pthread_mutex_lock(&m->lock);
+	while (1) {
+		struct output_file *o = m->queue;
+		if (!o) {
+			if (m->quit)
+				break;
+			pthread_cond_wait(&m->cond, &m->lock);
+			continue;
+		}
+		int quit = m->quit;
+		pthread_mutex_unlock(&m->lock);
+
+		// Rate limit is not used at exit to finish quickly
+		int ret = migrate_file(ts, o, !quit);
+
+		pthread_mutex_lock(&m->lock);
+		if (ret == 0 || quit) { // Give up at exit, the file stays in staging
+			if (ret < 0) {
+				m->failed++;
+				p_err("File %s is left in %s", o->filename, ts->output_dir);
+			}
+			m->queue = o->next_close;
+			m->queued--;
+			pthread_mutex_unlock(&m->lock);
+			migrate_done(ts, o, ret == 0);
+			pthread_mutex_lock(&m->lock);
+			retry = 0;
+			continue;
+		}
+		// Archive is not available, try the same file again later
+		m->retries++;
+		retry = retry ? retry * 2 : 1;
+		if (retry > MIGRATE_RETRY_MAX)
+			retry = MIGRATE_RETRY_MAX;
+		p_info(" *** Can't move file to archive, retry in %d sec (queued files: %u) ***\n",
+			retry, m->queued);
+		pthread_mutex_unlock(&m->lock);
+		migrate_wait(m, retry * 1000);
+		pthread_mutex_lock(&m->lock);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+// Queue the file that is left in staging by previous run
+static int migrate_leftover(struct ts *ts, const char *path, time_t start, int program, void *data) {
+	time_t *skip = data;
+	struct stat st;
+
+	if (start == *skip) // The current file, it is appended
+		return 0;
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	struct output_file *o = calloc(1, sizeof(struct output_file));
+	struct output *out = calloc(1, sizeof(struct output));
+	if (!o || !out)
+		die("Can't alloc %lu bytes.\n", (unsigned long)(sizeof(struct output_file) + sizeof(struct output)));
+	out->index   = -1;
+	out->program = program;
+	memset(out->cc, 0xff, sizeof(out->cc));
+
+	path += 2; // "./"
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	snprintf(o->filename, sizeof(o->filename), "%s", name);
+	snprintf(o->full_filename, sizeof(o->full_filename), "%s", path);
+	snprintf(o->dirname, sizeof(o->dirname), "%.*s", name > path ? (int)(name - path - 1) : 0, path);
+	o->out     = out;
+	o->startts = start;
+	o->size    = st.st_size;
+	o->fd      = -1;
+	pcr_reset(&o->pcr);
+
+	if (ts->manifest) {
+		o->fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (o->fd > -1) {
+			manifest_resume(out, o, path);
+			close(o->fd);
+			o->fd = -1;
+		}
+	}
+	p_info(" > File %s is left in %s, moving it to %s\n", path, ts->output_dir, ts->archive_dir);
+	migrate_add(ts, o);
+	return 0;
+}
+
+void migrate_init(struct ts *ts, mode_t dir_perm) {
+	struct migrate *m = calloc(1, sizeof(struct migrate));
+	if (!m)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct migrate));
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->cond, NULL);
+	m->dir_perm = dir_perm;
+	ts->migrate = m;
+	pthread_create(&m->thread, &ts->thread_attr, &migrate_thread, ts);
+
+	time_t current = time(NULL);
+	current -= current % ts->rotate_secs;
+	segment_scan(ts, ".", migrate_leftover, &current);
+}
+
+void migrate_free(struct ts *ts) {
+	struct migrate *m = ts->migrate;
+
+	pthread_mutex_lock(&m->lock);
+	m->quit = 1;
+	if (m->queued)
+		p_info("Archive    : moving %u files before exit\n", m->queued);
+	pthread_cond_signal(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+	pthread_join(m->thread, NULL);
+
+	p_info("Archive    : %lu files (%llu bytes) moved, max %llums, retries %lu, failed %lu\n",
+		m->files, m->bytes, m->max_msec, m->retries, m->failed);
+
+	pthread_mutex_destroy(&m->lock);
+	pthread_cond_destroy(&m->cond);
+	free(m);
+	ts->migrate = NULL;
+}
+
+// Called when the file is closed, the migrator takes the ownership of o
+void migrate_add(struct ts *ts, struct output_file *o) {
+	struct migrate *m = ts->migrate;
+	struct output_file **last;
+	pthread_mutex_lock(&m->lock);
+	o->next_close = NULL;
+	for (last = &m->queue; *last; last = &(*last)->next_close)
+		;
+	*last = o;
+	m->queued++;
+	pthread_cond_signal(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,179 @@
+/*
+ * MPEG transport stream helpers
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <string.h>
+
+#include "tsdumper2.h"
+
+#define PCR_MAX ((1ULL << 33) * 300)
+
+static uint32_t crc_table[256];
+
+static void crc_table_init(void) {
+	uint32_t i, j, crc;
+	for (i = 0; i < 256; i++) {
+		crc = i << 24;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+		crc_table[i] = crc;
+	}
+}
+
+// CRC32 used by PSI sections. Over a whole section (with its CRC) it is 0.
+uint32_t ts_crc32(uint8_t *data, int len) {
+	uint32_t crc = 0xffffffff;
+	int i;
+	if (!crc_table[1])
+		crc_table_init();
+	for (i = 0; i < len; i++)
+		crc = (crc << 8) ^ crc_table[((crc >> 24) ^ data[i]) & 0xff];
+	return crc;
+}
+
+/*
+ * Collect PSI section from TS packets. Returns the section length when
+ * the section in psi->data is complete, otherwise returns 0.
+ */
+int psi_push(struct psi_buf *psi, uint8_t *pkt) {
+	uint8_t *payload = pkt + 4;
+	int payload_len = TS_PACKET_SIZE - 4;
+	int cc = pkt[3] & 0x0f;
+
+	if (!(pkt[3] & 0x10)) // No payload
+		return 0;
+	if (pkt[3] & 0x20) { // Adaptation field
+		payload_len -= 1 + pkt[4];
+		payload += 1 + pkt[4];
+	}
+
+	if (pkt[1] & 0x40) { // Payload unit start, skip pointer_field
+		payload_len -= 1 + payload[0];
+		payload += 1 + payload[0];
+		psi->len = 0;
+	} else if (!psi->len || cc != ((psi->cc + 1) & 0x0f)) {
+		psi->len = 0;
+		return 0;
+	}
+	psi->cc = cc;
+	if (payload_len <= 0) {
+		psi->len = 0;
+		return 0;
+	}
+
+	if (payload_len > (int)sizeof(psi->data) - psi->len)
+		payload_len = sizeof(psi->data) - psi->len;
+	memcpy(psi->data + psi->len, payload, payload_len);
+	psi->len += payload_len;
+
+	if (psi->len < 3)
+		return 0;
+	int section_len = 3 + (((psi->data[1] & 0x0f) << 8) | psi->data[2]);
+	if (section_len > 1024) {
+		psi->len = 0;
+		return 0;
+	}
+	if (psi->len < section_len)
+		return 0;
+	psi->len = 0;
+	return section_len;
+}
+
+/*
+ * Count continuity counter errors. cc has the last counter of each PID,
+ * 0xff means that it is not known yet.
+ */
+unsigned int cc_scan(uint8_t *cc, uint8_t *data, int data_len) {
+	unsigned int errors = 0;
+	int i;
+	for (i = 0; i + TS_PACKET_SIZE <= data_len; i += TS_PACKET_SIZE) {
+		uint8_t *pkt = data + i;
+		if (pkt[0] != 0x47)
+			continue;
+		int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+		if (pid == 0x1fff || !(pkt[3] & 0x10)) // Null packet or no payload
+			continue;
+		uint8_t cur = pkt[3] & 0x0f;
+		uint8_t last = cc[pid];
+		cc[pid] = cur;
+		if (last == 0xff || cur == ((last + 1) & 0x0f))
+			continue;
+		if (cur == last) // Duplicate packet is allowed
+			continue;
+		if ((pkt[3] & 0x20) && pkt[4] && (pkt[5] & 0x80)) // discontinuity_indicator
+			continue;
+		errors++;
+	}
+	return errors;
+}
+
+static int ts_packet_pcr(uint8_t *pkt, uint64_t *pcr) {
+	if (!(pkt[3] & 0x20) || pkt[4] < 7 || !(pkt[5] & 0x10))
+		return 0;
+	uint64_t base = ((uint64_t)pkt[6] << 25) | (pkt[7] << 17) | (pkt[8] << 9) | (pkt[9] << 1) | (pkt[10] >> 7);
+	uint64_t ext  = ((pkt[10] & 1) << 8) | pkt[11];
+	*pcr = base * 300 + ext;
+	return 1;
+}
+
+uint64_t pcr_diff(uint64_t from, uint64_t to) {
+	return (to + PCR_MAX - from) % PCR_MAX;
+}
+
+void pcr_reset(struct pcr_info *pcr) {
+	memset(pcr, 0, sizeof(*pcr));
+	pcr->pid = -1;
+}
+
+/*
+ * Remember the first and the last PCR in data. pos is the offset of data
+ * in the output file. Only the first PID that carries PCR is used.
+ */
+void pcr_scan(struct pcr_info *pcr, uint8_t *data, int data_len, off_t pos) {
+	int i;
+	uint64_t value;
+	for (i = 0; i + TS_PACKET_SIZE <= data_len; i += TS_PACKET_SIZE) {
+		uint8_t *pkt = data + i;
+		if (pkt[0] != 0x47)
+			continue;
+		int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+		if (pcr->pid > -1 && pid != pcr->pid)
+			continue;
+		if (!ts_packet_pcr(pkt, &value))
+			continue;
+		pcr->pid = pid;
+		if (!pcr->count++) {
+			pcr->first     = value;
+			pcr->first_pos = pos + i;
+		}
+		pcr->last     = value;
+		pcr->last_pos = pos + i;
+	}
+}
+
+/*
+ * Return the duration of size bytes in seconds. The bitrate is measured
+ * between the first and the last PCR and the bytes before the first and
+ * after the last PCR are added using that bitrate. Returns 0 if the
+ * duration can't be calculated.
+ */
+double pcr_duration(struct pcr_info *pcr, off_t size) {
+	if (pcr->count < 2 || pcr->last_pos <= pcr->first_pos)
+		return 0;
+	uint64_t diff = pcr_diff(pcr->first, pcr->last);
+	double secs = (double)diff / 27000000;
+	// Discontinuity, PCR jumped more than a day
+	if (!diff || secs > 86400)
+		return 0;
+	return secs * size / (pcr->last_pos - pcr->first_pos);
+}
@@ -0,0 +1,243 @@
+/*
+ * HLS playlist of the recorded files
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "tsdumper2.h"
+
+// Longest line in the playlist: "#EXTINF:123456.789,\n" + uri + "\n"
+#define PLAYLIST_LINE_MAX (OUTFILE_NAME_MAX + 32)
+
+struct hls_segment {
+	double				duration;
+	int					discontinuity;
+	char				uri[OUTFILE_NAME_MAX];
+};
+
+struct playlist {
+	char				filename[PATH_MAX];
+	char				tmp_filename[PATH_MAX + 8];
+	int					window;						// segments in the playlist, 0 == EVENT playlist
+	int					target;						// EXT-X-TARGETDURATION
+
+	struct hls_segment	*segs;						// ring buffer for sliding window
+	int					head;
+	int					count;
+	int					alloc;
+	unsigned long long	media_seq;					// sequence of the first segment
+
+	char				*buf;						// playlist text
+	size_t				buf_size;
+
+	int					have_pcr;
+	uint64_t			last_pcr;					// last PCR of the previous segment
+	int					restarted;					// segments are loaded from previous run
+};
+
+// Returns the place for new segment at the end of the playlist
+static struct hls_segment *playlist_push(struct playlist *pl) {
+	if (pl->count == pl->alloc) {
+		if (pl->window) { // Slide the window
+			pl->head = (pl->head + 1) % pl->alloc;
+			pl->count--;
+			pl->media_seq++;
+		} else { // EVENT playlist keeps all segments
+			pl->alloc *= 2;
+			pl->segs = realloc(pl->segs, pl->alloc * sizeof(struct hls_segment));
+			pl->buf_size = 256 + pl->alloc * PLAYLIST_LINE_MAX;
+			pl->buf = realloc(pl->buf, pl->buf_size);
+			if (!pl->segs || !pl->buf)
+				die("Can't alloc %lu bytes.\n", (unsigned long)pl->buf_size);
+			// The ring was full, so it starts at head and wraps at the old size
+			memmove(pl->segs + pl->count, pl->segs, pl->head * sizeof(struct hls_segment));
+		}
+	}
+	struct hls_segment *seg = &pl->segs[(pl->head + pl->count) % pl->alloc];
+	memset(seg, 0, sizeof(*seg));
+	pl->count++;
+	return seg;
+}
+
+/*
+ * Continue the playlist that was written before restart, so the media
+ * sequence does not go back and EVENT playlist keeps its segments.
+ */
+static void playlist_load(struct playlist *pl) {
+	char line[PLAYLIST_LINE_MAX];
+	double duration = 0;
+	int discontinuity = 0;
+
+	FILE *f = fopen(pl->filename, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, "#EXT-X-TARGETDURATION:", 22) == 0) {
+			int target = atoi(line + 22);
+			if (target > pl->target)
+				pl->target = target;
+		} else if (strncmp(line, "#EXT-X-MEDIA-SEQUENCE:", 22) == 0) {
+			pl->media_seq = strtoull(line + 22, NULL, 10);
+		} else if (strcmp(line, "#EXT-X-DISCONTINUITY") == 0) {
+			discontinuity = 1;
+		} else if (strncmp(line, "#EXTINF:", 8) == 0) {
+			duration = strtod(line + 8, NULL);
+		} else if (line[0] && line[0] != '#') {
+			size_t len = strlen(line);
+			if (len >= sizeof(((struct hls_segment *)0)->uri))
+				continue;
+			struct hls_segment *seg = playlist_push(pl);
+			seg->duration      = duration;
+			seg->discontinuity = discontinuity;
+			memcpy(seg->uri, line, len + 1);
+			duration      = 0;
+			discontinuity = 0;
+		}
+	}
+	fclose(f);
+	pl->restarted = pl->count > 0;
+	p_info("Playlist   : continue %s (%d files, media sequence %llu)\n",
+		pl->filename, pl->count, pl->media_seq);
+}
+
+void playlist_init(struct ts *ts, struct output *out) {
+	char name[PATH_MAX];
+	struct playlist *pl = calloc(1, sizeof(struct playlist));
+	if (!pl)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct playlist));
+	if (out->program) { // live.m3u8 -> live-PROGRAM.m3u8
+		int len = strlen(ts->hls_playlist);
+		char *ext = strrchr(ts->hls_playlist, '.');
+		if (ext && !strchr(ext, '/'))
+			len = ext - ts->hls_playlist;
+		else
+			ext = "";
+		snprintf(name, sizeof(name), "%.*s-%d%s",
+			len, ts->hls_playlist, out->program, ext);
+	} else {
+		snprintf(name, sizeof(name), "%s", ts->hls_playlist);
+	}
+	// The files are listed after they are moved, the URIs are relative to the archive
+	if (ts->archive_dir && name[0] != '/') {
+		if (snprintf(pl->filename, sizeof(pl->filename), "%s/%s", ts->archive_dir, name) >= (int)sizeof(pl->filename))
+			die("HLS playlist path is too long: %s/%s", ts->archive_dir, name);
+	} else
+		snprintf(pl->filename, sizeof(pl->filename), "%s", name);
+	snprintf(pl->tmp_filename, sizeof(pl->tmp_filename), "%s.tmp", pl->filename);
+	pl->window = ts->hls_window;
+	pl->target = ts->rotate_secs;
+	pl->alloc  = pl->window ? pl->window : 64;
+	pl->segs   = calloc(pl->alloc, sizeof(struct hls_segment));
+	if (!pl->segs)
+		die("Can't alloc %lu bytes.\n", (unsigned long)(pl->alloc * sizeof(struct hls_segment)));
+	pl->buf_size = 256 + pl->alloc * PLAYLIST_LINE_MAX;
+	pl->buf = malloc(pl->buf_size);
+	if (!pl->buf)
+		die("Can't alloc %lu bytes.\n", (unsigned long)pl->buf_size);
+	playlist_load(pl);
+	out->playlist = pl;
+}
+
+static void playlist_write(struct playlist *pl, int end) {
+	size_t len = 0;
+	int i;
+
+	len += snprintf(pl->buf + len, pl->buf_size - len,
+		"#EXTM3U\n"
+		"#EXT-X-VERSION:3\n"
+		"#EXT-X-TARGETDURATION:%d\n"
+		"#EXT-X-MEDIA-SEQUENCE:%llu\n",
+		pl->target, pl->media_seq);
+	if (!pl->window)
+		len += snprintf(pl->buf + len, pl->buf_size - len, "#EXT-X-PLAYLIST-TYPE:EVENT\n");
+
+	for (i = 0; i < pl->count; i++) {
+		struct hls_segment *seg = &pl->segs[(pl->head + i) % pl->alloc];
+		if (seg->discontinuity)
+			len += snprintf(pl->buf + len, pl->buf_size - len, "#EXT-X-DISCONTINUITY\n");
+		len += snprintf(pl->buf + len, pl->buf_size - len, "#EXTINF:%.3f,\n%s\n",
+			seg->duration, seg->uri);
+	}
+	if (end)
+		len += snprintf(pl->buf + len, pl->buf_size - len, "#EXT-X-ENDLIST\n");
+
+	// Write the new playlist and replace the old one atomically
+	int fd = open(pl->tmp_filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0) {
+		p_err("Can't create playlist %s", pl->tmp_filename);
+		return;
+	}
+	ssize_t written = write(fd, pl->buf, len);
+	close(fd);
+	if (written != (ssize_t)len) {
+		p_err("Can not write playlist (written %zd of %zu file:%s)", written, len, pl->tmp_filename);
+		unlink(pl->tmp_filename);
+		return;
+	}
+	if (rename(pl->tmp_filename, pl->filename) < 0)
+		p_err("Can't rename %s to %s", pl->tmp_filename, pl->filename);
+}
+
+/*
+ * Called from write_thread when the file is closed. The duration is
+ * taken from the PCR, if the segment has no usable PCR it is assumed
+ * to be default_duration seconds long.
+ */
+void playlist_add(struct output *out, char *uri, struct pcr_info *pcr, off_t size, double default_duration) {
+	struct playlist *pl = out->playlist;
+	struct hls_segment *seg = NULL;
+
+	// The file that was closed at exit is appended after restart
+	if (pl->count) {
+		seg = &pl->segs[(pl->head + pl->count - 1) % pl->alloc];
+		if (strcmp(seg->uri, uri) != 0)
+			seg = NULL;
+	}
+	if (!seg) {
+		seg = playlist_push(pl);
+		// More than a second between the segments means that something is lost
+		seg->discontinuity = pl->restarted ||
+			(pl->have_pcr && pcr->count && pcr_diff(pl->last_pcr, pcr->first) > 27000000);
+		snprintf(seg->uri, sizeof(seg->uri), "%s", uri);
+	}
+	pl->restarted = 0;
+	seg->duration = pcr_duration(pcr, size);
+	if (!seg->duration)
+		seg->duration = default_duration;
+
+	pl->have_pcr = pcr->count > 0;
+	pl->last_pcr = pcr->last;
+
+	// Must not change while the playlist is in use, so only grow it
+	int target = (int)(seg->duration + 0.5);
+	if (target > pl->target)
+		pl->target = target;
+
+	playlist_write(pl, 0);
+}
+
+void playlist_free(struct output *out) {
+	struct playlist *pl = out->playlist;
+	if (!pl->window)
+		playlist_write(pl, 1);
+	free(pl->segs);
+	free(pl->buf);
+	free(pl);
+	out->playlist = NULL;
+}
@@ -19,110 +19,470 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
 #include "tsdumper2.h"
 
-#define NO_UNLINK  0
-#define UNLINK_OLD 1
-
 #define ALIGN_DOWN(__src, __value) (__src - (__src % __value))
 
+#define RECOVER_TAIL_SIZE (FRAME_SIZE * 64)		// bytes checked at the end of appended file
+#define RECOVER_SYNC      5						// packets in sync before the end
+
 static mode_t dir_perm;
 
-static int file_exists(char *filename) {
-	return access(filename, W_OK) == 0;
-}
+/*
+ * The next file is created by tsdump-rotate thread before it is needed
+ * and closed files are given back to it, so the rotation in write_thread
+ * is just a pointer swap. The thread also keeps the directory of the
+ * current hour open and creates the files with openat(). The manifest
+ * of the file that is being written is saved by it from the copy of the
+ * state made by the writer.
+ */
+struct rotate {
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_cond_t		prepared;					// signaled when file preparation is done
+	int					quit;
+
+	struct output_file	*closing;					// files to close (FIFO)
+
+	pthread_mutex_t		dir_lock;
+	int					base_fd;					// output directory
+	int					dir_fd;						// YYYY/MM/DD/HH directory
+	char				dir_name[OUTFILE_NAME_MAX];
+
+	unsigned long		rotations;
+	unsigned long		misses;						// next file was not ready
+	unsigned long long	total_usec;
+	unsigned long long	max_usec;
+};
 
-static void format_output_filename(struct ts *ts, time_t file_time) {
+static void format_output_filename(struct output *out, struct output_file *o, time_t file_time) {
 	struct tm file_tm;
 	localtime_r(&file_time, &file_tm);
 
-	ts->output_startts = file_time;
+	o->startts = file_time;
 
-	ts->output_filename[0] = '\0';
-	strcat(ts->output_filename, ts->prefix);
-	strcat(ts->output_filename, "-");
-	strftime(ts->output_filename + strlen(ts->output_filename), OUTFILE_NAME_MAX, "%Y%m%d_%H%M%S-%s.ts", &file_tm);
+	o->filename[0] = '\0';
+	strcat(o->filename, out->prefix);
+	strcat(o->filename, "-");
+	strftime(o->filename + strlen(o->filename), OUTFILE_NAME_MAX, OUTFILE_NAME_FMT, &file_tm);
 
-	ts->output_dirname[0] = '\0';
-	strftime(ts->output_dirname, OUTFILE_NAME_MAX, "%Y/%m/%d/%H", &file_tm);
+	o->dirname[0] = '\0';
+	strftime(o->dirname, OUTFILE_NAME_MAX, OUTFILE_DIR_FMT, &file_tm);
 
-	ts->output_full_filename[0] = '\0';
-	snprintf(ts->output_full_filename, sizeof(ts->output_full_filename), "%s/%s",
-		ts->output_dirname, ts->output_filename);
+	o->full_filename[0] = '\0';
+	snprintf(o->full_filename, sizeof(o->full_filename), "%s/%s",
+		o->dirname, o->filename);
 }
 
-static void report_file_creation(struct ts *ts, char *text_prefix, char *filename) {
+// File name relative to the output directory
+static char *output_path(struct ts *ts, struct output_file *o) {
+	return ts->create_dirs ? o->full_filename : o->filename;
+}
+
+static void report_file_creation(struct ts *ts, char *text_prefix, char *filename, unsigned long long usec) {
 	char qdepth[32];
 	qdepth[0] = '\0';
 	if (ts->packet_queue->items)
 		snprintf(qdepth, sizeof(qdepth), " (depth:%d)", ts->packet_queue->items);
-	p_info("%s%s%s\n", text_prefix, filename, qdepth);
+	p_info("%s%s%s (rotate:%lluus)\n", text_prefix, filename, qdepth, usec);
+}
+
+// Open (and create if needed) YYYY/MM/DD/HH relative to the output directory
+static int open_dir(struct rotate *r, const char *dirname) {
+	char name[OUTFILE_NAME_MAX];
+	const char *p = dirname;
+	int fd = r->base_fd;
+
+	while (*p) {
+		const char *slash = strchr(p, '/');
+		size_t len = slash ? (size_t)(slash - p) : strlen(p);
+		memcpy(name, p, len);
+		name[len] = '\0';
+		if (mkdirat(fd, name, dir_perm) == 0)
+			p_info(" = Create directory %.*s\n", (int)(p + len - dirname), dirname);
+		int dir_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd != r->base_fd)
+			close(fd);
+		if (dir_fd < 0) {
+			p_err("Can't open directory %s", dirname);
+			return -1;
+		}
+		fd = dir_fd;
+		p += len;
+		if (*p == '/')
+			p++;
+	}
+	return fd;
 }
 
-static void create_output_directory(struct ts *ts) {
+/*
+ * Return a copy of the fd of the directory of the file, the caller must
+ * close it. The cached fd can be replaced by another thread at any time.
+ * reopen is used when the directory was removed (tsdump-migrate removes
+ * empty staging directories).
+ */
+static int output_dir_fd(struct ts *ts, struct output_file *o, int reopen) {
+	struct rotate *r = ts->rotate;
+	int fd;
+
 	if (!ts->create_dirs)
+		return dup(r->base_fd);
+
+	pthread_mutex_lock(&r->dir_lock);
+	if (reopen || r->dir_fd < 0 || strcmp(r->dir_name, o->dirname) != 0) {
+		if (r->dir_fd > -1)
+			close(r->dir_fd);
+		r->dir_fd = open_dir(r, o->dirname);
+		strcpy(r->dir_name, o->dirname);
+	}
+	fd = r->dir_fd > -1 ? dup(r->dir_fd) : -1;
+	pthread_mutex_unlock(&r->dir_lock);
+	return fd;
+}
+
+/*
+ * Return the end of the last complete packet in buf which is in sync
+ * with the RECOVER_SYNC packets before it (or with all packets from the
+ * start when buf is the whole file). Returns -1 if there is no such packet.
+ */
+static int tail_valid_end(uint8_t *buf, int len, int whole_file) {
+	int pos, i;
+	for (pos = len - TS_PACKET_SIZE; pos >= 0; pos--) {
+		for (i = 0; i < RECOVER_SYNC && pos - i * TS_PACKET_SIZE >= 0; i++) {
+			if (buf[pos - i * TS_PACKET_SIZE] != 0x47)
+				break;
+		}
+		if (i == RECOVER_SYNC || (whole_file && pos % TS_PACKET_SIZE == 0 && pos - i * TS_PACKET_SIZE < 0))
+			return pos + TS_PACKET_SIZE;
+	}
+	return -1;
+}
+
+/*
+ * After a crash the file can end with partial packet, half written chunk
+ * or zeroes (on some file systems). Only the tail of the file is read,
+ * the file is cut after the last valid packet and the state of the file
+ * (manifest, PCR) is restored without reading the whole file.
+ */
+static void output_recover(struct ts *ts, struct output *out, struct output_file *o) {
+	struct timespec start, end;
+	off_t tail_start, cut = 0, readen = 0;
+	int len;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tail_start = o->size > RECOVER_TAIL_SIZE ? o->size - RECOVER_TAIL_SIZE : 0;
+	len = o->size - tail_start;
+	if (!len)
+		return;
+
+	uint8_t *buf = malloc(len);
+	if (!buf)
+		die("Can't alloc %d bytes.\n", len);
+	if (pread(o->fd, buf, len, tail_start) != len) {
+		p_err("Can't read the end of %s", output_path(ts, o));
+		free(buf);
 		return;
-	if (!file_exists(ts->output_dirname)) {
-		p_info(" = Create directory %s", ts->output_dirname);
-		create_dir(ts->output_dirname, dir_perm);
 	}
+
+	int valid = tail_valid_end(buf, len, tail_start == 0);
+	if (valid < 0) {
+		p_err("No valid packets at the end of %s, it is appended as is", output_path(ts, o));
+		valid = len;
+	} else if (valid < len) {
+		if (ftruncate(o->fd, tail_start + valid) < 0) {
+			p_err("Can't cut %s to %llu bytes", output_path(ts, o), (unsigned long long)(tail_start + valid));
+			valid = len;
+		} else {
+			cut = len - valid;
+			o->size = tail_start + valid;
+		}
+	}
+
+	if (ts->manifest) {
+		readen = manifest_resume(out, o, output_path(ts, o));
+	} else if (out->playlist) {
+		// The duration is measured between the PCRs in the tail
+		int first = valid % TS_PACKET_SIZE;
+		pcr_scan(&o->pcr, buf + first, valid - first, tail_start + first);
+	}
+	free(buf);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unsigned long long usec = (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+	if (cut || readen)
+		p_info(" + Recover file %s: cut %llu bytes at the end, read %llu bytes (%lluus)\n",
+			output_path(ts, o), (unsigned long long)cut, (unsigned long long)(len + readen), usec);
+}
+
+/*
+ * Prepared files are created with O_EXCL, so tsdump-rotate never
+ * truncates a file that is already written.
+ */
+static struct output_file *output_open(struct ts *ts, struct output *out, time_t file_time, int append, int prepare) {
+	struct output_file *o = calloc(1, sizeof(struct output_file));
+	if (!o)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct output_file));
+
+	o->out = out;
+	format_output_filename(out, o, file_time);
+	pcr_reset(&o->pcr);
+
+	int dir_fd = output_dir_fd(ts, o, 0);
+	if (dir_fd < 0)
+		goto ERR;
+
+	if (append) {
+		o->fd = openat(dir_fd, o->filename, O_APPEND | O_RDWR | O_CLOEXEC);
+		if (o->fd < 0) {
+			p_err("Can't append to output file %s", output_path(ts, o));
+			goto ERR;
+		}
+		o->size = lseek(o->fd, 0, SEEK_END);
+		output_recover(ts, out, o);
+	} else {
+		int flags = prepare ? O_EXCL : O_TRUNC;
+		o->fd = openat(dir_fd, o->filename, O_CREAT | O_WRONLY | flags | O_CLOEXEC, 0644);
+		if (o->fd < 0 && errno == ENOENT && ts->create_dirs) {
+			close(dir_fd);
+			dir_fd = output_dir_fd(ts, o, 1);
+			if (dir_fd < 0)
+				goto ERR;
+			o->fd = openat(dir_fd, o->filename, O_CREAT | O_WRONLY | flags | O_CLOEXEC, 0644);
+		}
+		if (o->fd < 0) {
+			p_err("Can't create output file %s", output_path(ts, o));
+			goto ERR;
+		}
+	}
+	close(dir_fd);
+	return o;
+
+ERR:
+	if (dir_fd > -1)
+		close(dir_fd);
+	free(o);
+	return NULL;
 }
 
-static int create_output_file(struct ts *ts) {
-	char *filename = ts->output_filename;
-	if (ts->create_dirs)
-		filename = ts->output_full_filename;
-	create_output_directory(ts);
-	report_file_creation(ts, " = Create new file ", filename);
-	int fd = open(ts->output_filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-	if (fd < 0) {
-		p_err("Can't create output file %s", ts->output_filename);
-		return -1;
+static void output_close(struct ts *ts, struct output_file *o) {
+	if (o->keep) {
+		if (ts->manifest)
+			manifest_write(o, output_path(ts, o), 0);
+		p_info(" = Keep file %s in %s until restart\n", output_path(ts, o), ts->output_dir);
+		close(o->fd);
+		free(o);
+		return;
 	}
-	if (ts->create_dirs) {
-		link(ts->output_filename, ts->output_full_filename);
+	if (ts->migrate) {
+		close(o->fd);
+		migrate_add(ts, o);
+		return;
 	}
-	return fd;
+	if (ts->manifest)
+		manifest_write(o, output_path(ts, o), 1);
+	if (ts->retention)
+		retention_add(ts, o->out, o->startts, o->size);
+	if (o->out->playlist)
+		playlist_add(o->out, output_path(ts, o), &o->pcr, o->size, ts->rotate_secs);
+	close(o->fd);
+	free(o);
 }
 
-static int append_output_file(struct ts *ts) {
-	char *filename = ts->output_filename;
-	if (ts->create_dirs)
-		filename = ts->output_full_filename;
-	create_output_directory(ts);
-	report_file_creation(ts, " + Append to file ", filename);
-	int fd = open(ts->output_filename, O_APPEND | O_WRONLY);
-	if (fd < 0) {
-		p_err("Can't append to output file %s", ts->output_filename);
-		return -1;
+// Prepared file that was not used, it is empty and only tsdump-rotate has it open
+static void output_discard(struct ts *ts, struct output_file *o) {
+	close(o->fd);
+	unlink(output_path(ts, o));
+	free(o);
+}
+
+// Returns 1 if something was done (the lock was released)
+static int rotate_prepare(struct ts *ts, struct output *out) {
+	struct rotate *r = ts->rotate;
+	struct output_file *o;
+
+	// Drop prepared file with wrong time (clock jump or input pause)
+	if (out->next && out->next->startts != out->want) {
+		o = out->next;
+		out->next = NULL;
+		pthread_mutex_unlock(&r->lock);
+		output_discard(ts, o);
+		pthread_mutex_lock(&r->lock);
+		return 1;
 	}
-	if (ts->create_dirs) {
-		link(ts->output_filename, ts->output_full_filename);
+	if (out->want && !out->next && !r->quit) {
+		time_t want = out->want;
+		out->preparing = want;
+		pthread_mutex_unlock(&r->lock);
+		o = output_open(ts, out, want, 0, 1);
+		pthread_mutex_lock(&r->lock);
+		if (o)
+			out->next = o;
+		else if (out->want == want)
+			out->want = 0; // write_thread will try again
+		out->preparing = 0;
+		pthread_cond_broadcast(&r->prepared);
+		return 1;
 	}
-	return fd;
+	return 0;
+}
+
+// Returns 1 if the manifest was saved (the lock was released)
+static int rotate_save(struct ts *ts) {
+	struct output_file o;
+	int i;
+
+	for (i = 0; i < ts->num_outputs; i++) {
+		struct output *out = ts->outputs[i];
+		if (!out->save_pending)
+			continue;
+		o = out->save;
+		out->save_pending = 0;
+		pthread_mutex_unlock(&ts->rotate->lock);
+		manifest_write(&o, output_path(ts, &o), 0);
+		pthread_mutex_lock(&ts->rotate->lock);
+		return 1;
+	}
+	return 0;
 }
 
-static void close_output_file(struct ts *ts, int unlink_file) {
-	if (ts->output_fd > -1) {
-		close(ts->output_fd);
-		if (unlink_file && ts->create_dirs) {
-			// The file is hard linked into the subdirectory. There is no need
-			// to keep it in the main directory.
-			unlink(ts->output_filename);
+static void *rotate_thread(void *_ts) {
+	struct ts *ts = _ts;
+	struct rotate *r = ts->rotate;
+	struct output_file *o;
+	int i, busy;
+
+	set_thread_name("tsdump-rotate");
+
+	pthread_mutex_lock(&r->lock);
+	while (1) {
+		// The next files are more urgent than closing the old ones
+		busy = 0;
+		for (i = 0; i < ts->num_outputs; i++)
+			busy |= rotate_prepare(ts, ts->outputs[i]);
+		if (busy)
+			continue;
+		// Before closing, so the old state never replaces the final manifest
+		if (rotate_save(ts))
+			continue;
+		if (r->closing) {
+			o = r->closing;
+			r->closing = o->next_close;
+			pthread_mutex_unlock(&r->lock);
+			output_close(ts, o);
+			pthread_mutex_lock(&r->lock);
+			continue;
 		}
+		if (r->quit)
+			break;
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	for (i = 0; i < ts->num_outputs; i++) {
+		o = ts->outputs[i]->next;
+		ts->outputs[i]->next = NULL;
+		if (o)
+			output_discard(ts, o);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static void rotate_init(struct ts *ts) {
+	struct rotate *r = calloc(1, sizeof(struct rotate));
+	if (!r)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct rotate));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_mutex_init(&r->dir_lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	pthread_cond_init(&r->prepared, NULL);
+	r->dir_fd  = -1;
+	r->base_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (r->base_fd < 0)
+		die("Can't open output directory: %s\n", strerror(errno));
+	ts->rotate = r;
+	pthread_create(&r->thread, &ts->thread_attr, &rotate_thread, ts);
+}
+
+static void rotate_free(struct ts *ts) {
+	struct rotate *r = ts->rotate;
+
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	if (r->rotations)
+		p_info("Rotation   : %lu files (not prepared: %lu), avg %lluus, max %lluus\n",
+			r->rotations, r->misses, r->total_usec / r->rotations, r->max_usec);
+
+	if (r->dir_fd > -1)
+		close(r->dir_fd);
+	close(r->base_fd);
+	pthread_mutex_destroy(&r->lock);
+	pthread_mutex_destroy(&r->dir_lock);
+	pthread_cond_destroy(&r->cond);
+	pthread_cond_destroy(&r->prepared);
+	free(r);
+	ts->rotate = NULL;
+}
+
+// Take the prepared file if it is for file_time and ask for the next one
+static struct output_file *rotate_next(struct ts *ts, struct output *out, time_t file_time, time_t next_time) {
+	struct rotate *r = ts->rotate;
+	struct output_file *o = NULL;
+	pthread_mutex_lock(&r->lock);
+	// The file is being created right now, wait for it instead of creating it again
+	while (out->preparing && out->preparing == file_time)
+		pthread_cond_wait(&r->prepared, &r->lock);
+	if (out->next && out->next->startts == file_time) {
+		o = out->next;
+		out->next = NULL;
 	}
+	out->want = next_time;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	return o;
+}
+
+static void rotate_close(struct ts *ts, struct output_file *o) {
+	struct rotate *r = ts->rotate;
+	struct output_file **last;
+	pthread_mutex_lock(&r->lock);
+	o->next_close = NULL;
+	for (last = &r->closing; *last; last = &(*last)->next_close)
+		;
+	*last = o;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
 }
 
-static void handle_files(struct ts *ts, struct packet *packet) {
-	int file_time = ALIGN_DOWN(packet->ts.tv_sec, ts->rotate_secs);
+static int output_exists(struct ts *ts, struct output *out, time_t file_time) {
+	struct output_file o;
+	format_output_filename(out, &o, file_time);
+	return access(output_path(ts, &o), W_OK) == 0;
+}
+
+static void handle_files(struct ts *ts, struct output *out, time_t packet_time) {
+	struct rotate *r = ts->rotate;
+	struct timespec start, end;
+	time_t file_time = ALIGN_DOWN(packet_time, ts->rotate_secs);
+	struct output_file *o = NULL;
+	int first = !out->file;
+	int append = 0;
 
 	// Is this file already created?
-	if (file_time <= ts->output_startts)
+	if (file_time <= out->startts)
 		return;
 
-	close_output_file(ts, UNLINK_OLD);
-	format_output_filename(ts, file_time);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (out->file) {
+		rotate_close(ts, out->file);
+		out->file = NULL;
+	}
 
 	/*
 	 * When tsdumper2 is started, try to continue writing into "current" file.
@@ -131,25 +491,119 @@ static void handle_files(struct ts *ts, struct packet *packet) {
 	 * If current file does not exist, create new file with the time of the start
 	 * (not aligned to rotate_secs).
 	 */
-	int append = 0;
-	if (ts->output_fd < 0) { // First file (or error).
-		append = file_exists(ts->output_filename);
-		if (!append) { // Create first file *NOT ALIGNED*
-			format_output_filename(ts, packet->ts.tv_sec);
-		}
+	if (first) { // First file (or error).
+		append = output_exists(ts, out, file_time);
+		if (!append) // Create first file *NOT ALIGNED*
+			file_time = packet_time;
+	}
+	out->startts = file_time;
+
+	time_t next_time = ALIGN_DOWN(file_time, ts->rotate_secs) + ts->rotate_secs;
+	if (!first)
+		o = rotate_next(ts, out, file_time, next_time);
+	int miss = !o && !first;
+	if (!o) {
+		o = output_open(ts, out, file_time, append, 0);
+		if (first)
+			rotate_next(ts, out, file_time, next_time);
+	}
+	out->file = o;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unsigned long long usec = (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+	// Writer threads rotate different outputs at the same time
+	pthread_mutex_lock(&r->lock);
+	r->rotations++;
+	r->misses += miss;
+	r->total_usec += usec;
+	if (usec > r->max_usec)
+		r->max_usec = usec;
+	pthread_mutex_unlock(&r->lock);
+
+	if (o) {
+		if (ts->retention)
+			retention_open(ts, out, o->startts);
+		report_file_creation(ts, append ? " + Append to file " : " = Create new file ", output_path(ts, o), usec);
 	}
+}
+
+struct output *output_new(struct ts *ts, int program) {
+	struct output *out = calloc(1, sizeof(struct output));
+	if (!out)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct output));
+	out->program = program;
+	memset(out->cc, 0xff, sizeof(out->cc));
+	if (program)
+		snprintf(out->prefix, sizeof(out->prefix), "%s-%d", ts->prefix, program);
+	else
+		snprintf(out->prefix, sizeof(out->prefix), "%s", ts->prefix);
+	if (ts->hls_playlist)
+		playlist_init(ts, out);
+
+	// tsdump-rotate thread walks the outputs
+	pthread_mutex_lock(&ts->rotate->lock);
+	out->index = ts->num_outputs;
+	ts->outputs[ts->num_outputs++] = out;
+	pthread_mutex_unlock(&ts->rotate->lock);
+	return out;
+}
+
+static void output_free(struct output *out) {
+	if (out->playlist)
+		playlist_free(out);
+	free(out->batch);
+	free(out);
+}
+
+void output_write(struct ts *ts, struct output *out, time_t packet_time, int lost, uint8_t *data, int data_len) {
+	handle_files(ts, out, packet_time);
 
-	ts->output_fd = append ? append_output_file(ts) : create_output_file(ts);
+	struct output_file *o = out->file;
+	if (!o)
+		return;
+
+	p_dbg2(" - Writing into fd:%d size:%d file:%s\n", o->fd, data_len, o->filename);
+	if (out->playlist || ts->manifest)
+		pcr_scan(&o->pcr, data, data_len, o->size);
+	ssize_t written = write(o->fd, data, data_len);
+	if (written != data_len && log_event(LOG_EV_WRITE_ERROR, data_len - (written > 0 ? written : 0))) {
+		p_err("Can not write data (fd:%d written %zd of %d file:%s)",
+			o->fd, written, data_len, o->filename);
+	}
+	if (written > 0) {
+		if (ts->manifest)
+			manifest_update(out, o, data, written);
+		o->size += written;
+	}
+	o->input_lost += lost;
+	if (ts->manifest && packet_time - o->saved >= MANIFEST_SAVE_SECS) {
+		// The manifest is written by tsdump-rotate
+		o->saved = packet_time;
+		pthread_mutex_lock(&ts->rotate->lock);
+		out->save = *o;
+		out->save_pending = 1;
+		pthread_cond_signal(&ts->rotate->cond);
+		pthread_mutex_unlock(&ts->rotate->lock);
+	}
 }
 
 void *write_thread(void *_ts) {
 	struct ts *ts = _ts;
 	struct packet *packet;
+	int i;
 
 	mode_t umask_val = umask(0);
 	dir_perm = (0777 & ~umask_val) | (S_IWUSR | S_IXUSR);
 
 	set_thread_name("tsdump-write");
+	if (ts->archive_dir)
+		migrate_init(ts, dir_perm);
+	rotate_init(ts);
+	if (!ts->demux)
+		output_new(ts, 0);
+	else if (ts->writers)
+		writer_init(ts);
+
 	while ((packet = queue_get(ts->packet_queue))) {
 		if (!packet->data_len)
 			continue;
@@ -158,23 +612,41 @@ void *write_thread(void *_ts) {
 			packet->num, packet->data_len, ALIGN_DOWN(packet->ts.tv_sec, ts->rotate_secs),
 			packet->ts.tv_sec, ts->packet_queue->items);
 
-		handle_files(ts, packet);
+		if (ts->demux)
+			demux_packet(ts, packet);
+		else
+			output_write(ts, ts->outputs[0], packet->ts.tv_sec, packet->lost, packet->data, packet->data_len);
+		if (ts->lowlat && !ts->writer)
+			lowlat_written(ts, &packet->ts);
 
-		if (ts->output_fd > -1) {
-			p_dbg2(" - Writing into fd:%d size:%d file:%s\n", ts->output_fd, packet->data_len, ts->output_filename);
-			ssize_t written = write(ts->output_fd, packet->data, packet->data_len);
-			if (written != packet->data_len) {
-				p_err("Can not write data (fd:%d written %zd of %d file:%s)",
-					ts->output_fd, written, packet->data_len, ts->output_filename);
-			}
-		}
 		free_packet(packet);
 	}
-	close_output_file(ts, NO_UNLINK);
+	if (ts->writer)
+		writer_free(ts);
+	time_t now = time(NULL);
+	for (i = 0; i < ts->num_outputs; i++) {
+		struct output_file *o = ts->outputs[i]->file;
+		if (o) {
+			// Restart in the same interval appends to the file, it is moved after that
+			if (ts->migrate && o->startts == ALIGN_DOWN(now, ts->rotate_secs))
+				o->keep = 1;
+			rotate_close(ts, o);
+			ts->outputs[i]->file = NULL;
+		}
+	}
+	rotate_free(ts);
+	if (ts->migrate)
+		migrate_free(ts);
+	for (i = 0; i < ts->num_outputs; i++)
+		output_free(ts->outputs[i]);
+	ts->num_outputs = 0;
 	return NULL;
 }
 
 static struct packet *add_to_queue(struct ts *ts) {
+	// Forwarded datagrams point into the packet
+	if (ts->fanout)
+		fanout_flush(ts);
 	queue_add(ts->packet_queue, ts->current_packet);
 	ts->current_packet = alloc_packet(ts);
 	return ts->current_packet;
@@ -184,24 +656,34 @@ void process_packets(struct ts *ts, uint8_t *ts_packet, ssize_t readen) {
 	struct timeval now;
 	struct packet *packet = ts->current_packet;
 
-	if (packet->data_len + readen < PACKET_MAX_LENGTH) {
-		// Add data to buffer
-		memcpy(packet->data + packet->data_len, ts_packet, readen);
-		packet->data_len += readen;
-	} else {
-		// Too much data, add to queue
+	if (packet->data_len + readen > PACKET_MAX_LENGTH) {
+		// Too much data, add to queue and start the next packet with this data
 		p_dbg1("*** Reached buffer end (%zd + %zd > %d)\n", packet->data_len + readen, readen, PACKET_MAX_LENGTH);
 		packet = add_to_queue(ts);
 	}
+	// Add data to buffer
+	memcpy(packet->data + packet->data_len, ts_packet, readen);
+	if (ts->fanout)
+		fanout_add(ts, packet->data + packet->data_len, readen);
+	packet->data_len += readen;
 
 	if (!packet->ts.tv_sec)
 		gettimeofday(&packet->ts, NULL);
 
 	gettimeofday(&now, NULL);
 	unsigned long long diff = timeval_diff_msec(&packet->ts, &now);
-	if (diff > PACKET_MAX_TIME) {
+	if (diff > (unsigned long long)ts->packet_max_time) {
 		// Too much time have passed, add to queue
-		p_dbg1("+++ Reached time limit (%llu > %d)\n", diff, PACKET_MAX_TIME);
+		p_dbg1("+++ Reached time limit (%llu > %d)\n", diff, ts->packet_max_time);
 		add_to_queue(ts);
 	}
 }
+
+// Hand the chunk to write_thread when it is older than the budget, used while there is no input
+void process_flush(struct ts *ts, struct timeval *now) {
+	struct packet *packet = ts->current_packet;
+	if (!packet->data_len)
+		return;
+	if (timeval_diff_msec(&packet->ts, now) > (unsigned long long)ts->packet_max_time)
+		add_to_queue(ts);
+}
@@ -0,0 +1,404 @@
+/*
+ * Retention manager - delete old recordings
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "tsdumper2.h"
+
+/*
+ * The catalog keeps only the start time and the size of each segment.
+ * The file name is generated from the start time the same way as
+ * format_output_filename() does it, so millions of segments fit in
+ * few megabytes of memory. Segments are kept sorted by start time.
+ *
+ * The directory is scanned by tsdump-retain thread, so a big archive
+ * does not delay the start of the recording. Nothing is deleted until
+ * the scan is finished.
+ */
+struct segment {
+	time_t				start;
+	off_t				size;
+	int					program;					// 0 == not demuxed
+};
+
+struct retention {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t			thread;
+	int					quit;
+	int					loaded;						// the directory is scanned
+
+	struct segment		*segs;
+	unsigned int		head;						// oldest segment
+	unsigned int		count;
+	unsigned int		alloc;
+	unsigned long long	total_bytes;
+	struct segment		current[MAX_OUTPUTS];		// segments that are being written
+
+	unsigned long long	deleted_files;
+	unsigned long long	deleted_bytes;
+};
+
+static void segment_path(struct ts *ts, time_t start, int program, int with_dir, char *path, size_t path_len) {
+	struct tm tm;
+	size_t len = 0;
+	localtime_r(&start, &tm);
+	if (with_dir) {
+		len = strftime(path, path_len, OUTFILE_DIR_FMT "/", &tm);
+	}
+	if (program)
+		len += snprintf(path + len, path_len - len, "%s-%d-", ts->prefix, program);
+	else
+		len += snprintf(path + len, path_len - len, "%s-", ts->prefix);
+	strftime(path + len, path_len - len, OUTFILE_NAME_FMT, &tm);
+}
+
+static void catalog_append(struct retention *r, time_t start, int program, off_t size) {
+	if (r->head + r->count == r->alloc) {
+		if (r->head > r->count) { // Reuse the space of deleted segments
+			memmove(r->segs, r->segs + r->head, r->count * sizeof(struct segment));
+			r->head = 0;
+		} else {
+			r->alloc = r->alloc ? r->alloc * 2 : 1024;
+			r->segs = realloc(r->segs, r->alloc * sizeof(struct segment));
+			if (!r->segs)
+				die("Can't alloc %lu bytes.\n", (unsigned long)(r->alloc * sizeof(struct segment)));
+		}
+	}
+	struct segment *seg = &r->segs[r->head + r->count];
+	seg->start   = start;
+	seg->size    = size;
+	seg->program = program;
+	r->count++;
+	r->total_bytes += size;
+}
+
+static int segment_cmp(const void *a, const void *b) {
+	const struct segment *sa = a, *sb = b;
+	if (sa->start < sb->start) return -1;
+	if (sa->start > sb->start) return  1;
+	return sa->program - sb->program;
+}
+
+static int is_number(const char *s) {
+	if (!*s)
+		return 0;
+	for (; *s; s++) {
+		if (*s < '0' || *s > '9')
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check PREFIX-YYYYMMDD_HHMMSS-0123456789.ts (or PREFIX-PROGRAM-... when
+ * the programs are split) and return the start time.
+ */
+static time_t parse_segment_name(struct ts *ts, const char *name, int *program) {
+	char path[OUTFILE_NAME_MAX];
+	size_t prefix_len = strlen(ts->prefix);
+	size_t len = strlen(name);
+
+	if (len <= prefix_len + 4 || strncmp(name, ts->prefix, prefix_len) != 0 || name[prefix_len] != '-')
+		return 0;
+	if (strcmp(name + len - 3, ".ts") != 0)
+		return 0;
+	const char *p = strrchr(name, '-');
+	if (!p)
+		return 0;
+	time_t start = strtol(p + 1, NULL, 10);
+	if (start <= 0)
+		return 0;
+	*program = 0;
+	if (name[prefix_len + 1] != '2' || name[prefix_len + 9] != '_') // Not YYYYMMDD_
+		*program = atoi(name + prefix_len + 1);
+
+	// The name must be the same as the one that will be used to delete it
+	segment_path(ts, start, *program, 0, path, sizeof(path));
+	if (strcmp(path, name) != 0)
+		return 0;
+
+	return start;
+}
+
+// Returns 1 if fn stopped the scan
+static int scan_dir(struct ts *ts, const char *dirname, int depth, segment_scan_cb fn, void *data) {
+	char path[PATH_MAX];
+	struct dirent *de;
+	int stop = 0;
+
+	DIR *dir = opendir(dirname);
+	if (!dir)
+		return 0;
+	while (!stop && (de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name) >= (int)sizeof(path))
+			continue;
+		if (depth < 4) { // YYYY/MM/DD/HH
+			if (ts->create_dirs && is_number(de->d_name))
+				stop = scan_dir(ts, path, depth + 1, fn, data);
+			continue;
+		}
+		int program;
+		time_t start = parse_segment_name(ts, de->d_name, &program);
+		if (start)
+			stop = fn(ts, path, start, program, data);
+	}
+	closedir(dir);
+	return stop;
+}
+
+// Call fn for every recorded file in dirname (and its YYYY/MM/DD/HH subdirs)
+void segment_scan(struct ts *ts, const char *dirname, segment_scan_cb fn, void *data) {
+	scan_dir(ts, dirname, ts->create_dirs ? 0 : 4, fn, data);
+}
+
+struct catalog_scan {
+	struct retention	*cat;						// not shared until the scan is done
+	unsigned int		ignored;
+};
+
+static int catalog_scan_cb(struct ts *ts, const char *path, time_t start, int program, void *data) {
+	struct retention *r = ts->retention;
+	struct catalog_scan *scan = data;
+	struct stat st;
+
+	pthread_mutex_lock(&r->lock);
+	int quit = r->quit;
+	pthread_mutex_unlock(&r->lock);
+	if (quit)
+		return 1;
+
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+		scan->ignored++;
+		return 0;
+	}
+	catalog_append(scan->cat, start, program, st.st_size);
+	return 0;
+}
+
+/*
+ * Scan the directory into new catalog and merge the files that were
+ * closed during the scan into it.
+ */
+static void retention_load(struct ts *ts) {
+	struct retention *r = ts->retention;
+	struct catalog_scan scan;
+	unsigned int i;
+
+	scan.cat = calloc(1, sizeof(struct retention));
+	scan.ignored = 0;
+	if (!scan.cat)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct retention));
+	segment_scan(ts, ts->archive_dir ? ts->archive_dir : ".", catalog_scan_cb, &scan);
+	struct retention *cat = scan.cat;
+	if (cat->count)
+		qsort(cat->segs, cat->count, sizeof(struct segment), segment_cmp);
+
+	pthread_mutex_lock(&r->lock);
+	unsigned int scanned = cat->count;
+	for (i = 0; i < r->count; i++) {
+		struct segment *seg = &r->segs[r->head + i];
+		struct segment *found = scanned ? bsearch(seg, cat->segs, scanned, sizeof(struct segment), segment_cmp) : NULL;
+		if (found) { // Appended after restart
+			cat->total_bytes += seg->size - found->size;
+			found->size = seg->size;
+		} else {
+			catalog_append(cat, seg->start, seg->program, seg->size);
+		}
+	}
+	if (cat->count != scanned)
+		qsort(cat->segs, cat->count, sizeof(struct segment), segment_cmp);
+	free(r->segs);
+	r->segs        = cat->segs;
+	r->head        = 0;
+	r->count       = cat->count;
+	r->alloc       = cat->alloc;
+	r->total_bytes = cat->total_bytes;
+	r->loaded      = 1;
+	p_info("Retention  : %u files, %llu bytes (ignored: %u)\n",
+		r->count, r->total_bytes, scan.ignored);
+	pthread_mutex_unlock(&r->lock);
+	free(cat);
+}
+
+static void remove_segment(struct ts *ts, struct segment *seg) {
+	struct retention *r = ts->retention;
+	char path[PATH_MAX];
+	size_t len = 0;
+	int i;
+
+	// Closed files are moved to the archive, so that is where they are deleted
+	if (ts->archive_dir)
+		len = snprintf(path, sizeof(path), "%s/", ts->archive_dir);
+	segment_path(ts, seg->start, seg->program, ts->create_dirs, path + len, sizeof(path) - len);
+	if (unlink(path) < 0 && errno != ENOENT) {
+		p_err("Can't remove old file %s", path);
+		return;
+	}
+	p_info(" - Remove old file %s\n", path);
+	if (ts->manifest) {
+		char manifest[PATH_MAX + 16];
+		snprintf(manifest, sizeof(manifest), "%s.manifest", path);
+		unlink(manifest);
+	}
+
+	// Remove YYYY/MM/DD/HH directories once they are empty
+	for (i = 0; ts->create_dirs && i < 4; i++) {
+		char *p = strrchr(path, '/');
+		if (!p)
+			break;
+		*p = '\0';
+		if (rmdir(path) < 0)
+			break;
+	}
+	r->deleted_files++;
+}
+
+// Returns the next segment to delete in *next or 0
+static int retention_next(struct ts *ts, time_t now, struct segment *next) {
+	struct retention *r = ts->retention;
+	int i;
+	if (!r->loaded || !r->count)
+		return 0;
+	struct segment *seg = &r->segs[r->head];
+	for (i = 0; i < MAX_OUTPUTS; i++) {
+		if (seg->start == r->current[i].start && seg->program == r->current[i].program)
+			return 0;
+	}
+	int expired = ts->max_age && now - seg->start > ts->max_age;
+	int over    = ts->max_bytes && r->total_bytes > ts->max_bytes;
+	if (!expired && !over)
+		return 0;
+	r->total_bytes   -= seg->size;
+	r->deleted_bytes += seg->size;
+	r->head++;
+	r->count--;
+	*next = *seg;
+	return 1;
+}
+
+static void *retention_thread(void *_ts) {
+	struct ts *ts = _ts;
+	struct retention *r = ts->retention;
+	struct timespec wait;
+
+	set_thread_name("tsdump-retain");
+	set_thread_low_prio();
+
+	retention_load(ts);
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->quit) {
+		long wait_ms = 1000;
+		struct segment seg;
+		if (retention_next(ts, time(NULL), &seg)) {
+			pthread_mutex_unlock(&r->lock);
+			remove_segment(ts, &seg);
+			pthread_mutex_lock(&r->lock);
+			// Deleting is limited to delete_rate files per second
+			wait_ms = 1000 / ts->delete_rate;
+		}
+		clock_gettime(CLOCK_REALTIME, &wait);
+		wait.tv_nsec += wait_ms * 1000000;
+		wait.tv_sec  += wait.tv_nsec / 1000000000;
+		wait.tv_nsec %= 1000000000;
+		if (!r->quit)
+			pthread_cond_timedwait(&r->cond, &r->lock, &wait);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+void retention_init(struct ts *ts) {
+	struct retention *r;
+
+	r = calloc(1, sizeof(struct retention));
+	if (!r)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct retention));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	ts->retention = r;
+	pthread_create(&r->thread, &ts->thread_attr, &retention_thread, ts);
+}
+
+void retention_free(struct ts *ts) {
+	struct retention *r = ts->retention;
+
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	p_info("Retention  : %llu files (%llu bytes) removed, %u files (%llu bytes) kept\n",
+		r->deleted_files, r->deleted_bytes, r->count, r->total_bytes);
+
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r->segs);
+	free(r);
+	ts->retention = NULL;
+}
+
+// Called from write_thread when new file is opened
+void retention_open(struct ts *ts, struct output *out, time_t start) {
+	struct retention *r = ts->retention;
+	pthread_mutex_lock(&r->lock);
+	r->current[out->index].start   = start;
+	r->current[out->index].program = out->program;
+	pthread_mutex_unlock(&r->lock);
+}
+
+// Called when the file is closed (or moved to the archive)
+void retention_add(struct ts *ts, struct output *out, time_t start, off_t size) {
+	struct retention *r = ts->retention;
+	unsigned int i;
+
+	pthread_mutex_lock(&r->lock);
+	// Files left in staging by previous run have no index
+	if (out->index >= 0 && r->current[out->index].start == start)
+		r->current[out->index].start = 0;
+	// The file may be in the catalog already (appended after restart)
+	struct segment key = { .start = start, .size = size, .program = out->program };
+	for (i = r->count; i > 0; i--) {
+		struct segment *seg = &r->segs[r->head + i - 1];
+		int cmp = segment_cmp(seg, &key);
+		if (cmp < 0)
+			break;
+		if (cmp == 0) {
+			r->total_bytes += size - seg->size;
+			seg->size = size;
+			goto OUT;
+		}
+	}
+	catalog_append(r, start, out->program, size);
+	if (i < r->count - 1) { // Older than the last one, insert at its place
+		struct segment *pos = &r->segs[r->head + i];
+		memmove(pos + 1, pos, (r->count - 1 - i) * sizeof(struct segment));
+		*pos = key;
+	}
+OUT:
+	pthread_mutex_unlock(&r->lock);
+}
@@ -23,6 +23,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 
 #include "tsdumper2.h"
 
@@ -34,15 +35,31 @@ static const char *program_id = PROGRAM_NAME " v" VERSION " (git-" GIT_VER ", bu
 static int keep_running = 1;
 static unsigned long long total_read;
 
-static const char short_options[] = "n:s:d:i:z46DhV";
+static const char short_options[] = "n:s:d:DT:B:A:Q:R:H:W:MP:w:m:i:I:fO:b:l:z46hV";
 
 static const struct option long_options[] = {
 	{ "prefix",				required_argument, NULL, 'n' },
 	{ "seconds",			required_argument, NULL, 's' },
 	{ "output-dir",			required_argument, NULL, 'd' },
 	{ "create-dirs",		no_argument,       NULL, 'D' },
+	{ "archive-dir",		required_argument, NULL, 'T' },
+	{ "archive-rate",		required_argument, NULL, 'B' },
+	{ "max-age",			required_argument, NULL, 'A' },
+	{ "max-size",			required_argument, NULL, 'Q' },
+	{ "delete-rate",		required_argument, NULL, 'R' },
+	{ "hls",				required_argument, NULL, 'H' },
+	{ "hls-window",			required_argument, NULL, 'W' },
+	{ "manifest",			no_argument,       NULL, 'M' },
+	{ "programs",			required_argument, NULL, 'P' },
+	{ "writers",			required_argument, NULL, 'w' },
+	{ "buffers",			required_argument, NULL, 'm' },
 
 	{ "input",				required_argument, NULL, 'i' },
+	{ "input2",				required_argument, NULL, 'I' },
+	{ "input-fec",			no_argument,       NULL, 'f' },
+	{ "forward",			required_argument, NULL, 'O' },
+	{ "busy-poll",			required_argument, NULL, 'b' },
+	{ "latency",			required_argument, NULL, 'l' },
 	{ "input-ignore-disc",	no_argument,       NULL, 'z' },
 	{ "ipv4",				no_argument,       NULL, '4' },
 	{ "ipv6",				no_argument,       NULL, '6' },
@@ -64,6 +81,17 @@ static void show_help(struct ts *ts) {
 	printf(" -s --seconds <seconds>     | How much to save (default: %u sec).\n", ts->rotate_secs);
 	printf(" -d --output-dir <dir>      | Startup directory (default: %s).\n", ts->output_dir);
 	printf(" -D --create-dirs           | Save files in subdirs YYYY/MM/DD/HH/file.\n");
+	printf(" -T --archive-dir <dir>     | Move closed files from output dir to <dir>.\n");
+	printf(" -B --archive-rate <MB/s>   | Limit the speed of moving (default: unlimited).\n");
+	printf(" -A --max-age <seconds>     | Delete files older than <seconds> (default: keep).\n");
+	printf(" -Q --max-size <MB>         | Delete oldest files above <MB> total (default: keep).\n");
+	printf(" -R --delete-rate <files>   | Delete up to <files> per second (default: %d).\n", ts->delete_rate);
+	printf(" -H --hls <file.m3u8>       | Write HLS playlist of the recorded files.\n");
+	printf(" -W --hls-window <files>    | Files in the playlist, 0 = all (default: %d).\n", ts->hls_window);
+	printf(" -M --manifest              | Write NAME.manifest with CRC32C for each file.\n");
+	printf(" -P --programs <all|N,N...> | Save each program in separate files PREFIX-N-...\n");
+	printf(" -w --writers <threads>     | Write the programs with pool of <threads>.\n");
+	printf(" -m --buffers <count>       | Preallocated 1.3 MB input buffers (default: %d).\n", ts->num_packets);
 	printf("\n");
 	printf("Input options:\n");
 	printf(" -i --input <source>        | Where to read from.\n");
@@ -71,6 +99,14 @@ static void show_help(struct ts *ts) {
 	printf("                            .  -i udp://[ff01::1111]:5000 (v6 multicast)\n");
 	printf("                            .  -i rtp://224.0.0.1:5000    (v4 RTP input)\n");
 	printf("                            .  -i rtp://[ff01::1111]:5000 (v6 RTP input)\n");
+	printf(" -I --input2 <source>       | Redundant copy of the input (RTP only).\n");
+	printf("                            .  Both inputs are merged by RTP sequence number.\n");
+	printf(" -f --input-fec             | Use SMPTE 2022-1 FEC from port+2/port+4 (RTP only).\n");
+	printf(" -O --forward <dest>        | Send the input to udp:// or rtp:// <dest>.\n");
+	printf("                            .  Can be used up to %d times.\n", FORWARD_MAX);
+	printf(" -b --busy-poll <cpu>       | Busy poll the input on <cpu> (lowest latency).\n");
+	printf(" -l --latency <ms>          | Write the data at most <ms> after arrival.\n");
+	printf("                            .  Default with --busy-poll: %d ms.\n", LATENCY_BUDGET);
 	printf(" -z --input-ignore-disc     | Do not report discontinuty errors in input.\n");
 	printf(" -4 --ipv4                  | Use only IPv4 addresses.\n");
 	printf(" -6 --ipv6                  | Use only IPv6 addresses.\n");
@@ -101,9 +137,77 @@ static void parse_options(struct ts *ts, int argc, char **argv) {
 			case 'D': // --create-dirs
 				ts->create_dirs = !ts->create_dirs;
 				break;
+			case 'T': // --archive-dir
+				ts->archive_dir = optarg;
+				break;
+			case 'B': // --archive-rate
+				ts->archive_rate = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			case 'A': // --max-age
+				ts->max_age = atol(optarg);
+				break;
+			case 'Q': // --max-size
+				ts->max_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			case 'R': // --delete-rate
+				ts->delete_rate = atoi(optarg);
+				if (ts->delete_rate < 1 || ts->delete_rate > 1000)
+					die("Delete rate must be between 1 and 1000.");
+				break;
+			case 'H': // --hls
+				ts->hls_playlist = optarg;
+				if (strlen(optarg) >= OUTFILE_NAME_MAX)
+					die("Playlist name is longer than %d characters!", OUTFILE_NAME_MAX);
+				break;
+			case 'W': // --hls-window
+				ts->hls_window = atoi(optarg);
+				if (ts->hls_window < 0)
+					die("HLS window can't be negative.");
+				break;
+			case 'M': // --manifest
+				ts->manifest = !ts->manifest;
+				break;
+			case 'P': // --programs
+				ts->programs = optarg;
+				break;
+			case 'w': // --writers
+				ts->writers = atoi(optarg);
+				if (ts->writers < 0 || ts->writers > WRITERS_MAX)
+					die("Writers must be between 0 and %d.", WRITERS_MAX);
+				break;
+			case 'm': // --buffers
+				ts->num_packets = atoi(optarg);
+				if (ts->num_packets < 2 || ts->num_packets > 1024)
+					die("Buffers must be between 2 and 1024.");
+				break;
 			case 'i': // --input
 				input_addr_err = !parse_host_and_port(optarg, &ts->input);
 				break;
+			case 'I': // --input2
+				if (!parse_host_and_port(optarg, &ts->input2))
+					die("Input2 address is invalid: %s", optarg);
+				break;
+			case 'f': // --input-fec
+				ts->input.fec = !ts->input.fec;
+				break;
+			case 'O': // --forward
+				if (ts->num_forward >= FORWARD_MAX)
+					die("Too many forward destinations (max %d).", FORWARD_MAX);
+				if (!parse_host_and_port(optarg, &ts->forward[ts->num_forward]))
+					die("Forward address is invalid: %s", optarg);
+				ts->num_forward++;
+				break;
+			case 'b': // --busy-poll
+				ts->busy_poll = 1;
+				ts->busy_poll_cpu = atoi(optarg);
+				if (ts->busy_poll_cpu < 0)
+					die("Busy poll CPU can't be negative.");
+				break;
+			case 'l': // --latency
+				ts->latency = atoi(optarg);
+				if (ts->latency < 1 || ts->latency > PACKET_MAX_TIME)
+					die("Latency must be between 1 and %d ms.", PACKET_MAX_TIME);
+				break;
 			case 'z': // --input-ignore-disc
 				ts->ts_discont = !ts->ts_discont;
 				break;
@@ -129,15 +233,63 @@ static void parse_options(struct ts *ts, int argc, char **argv) {
 			fprintf(stderr, "ERROR: Input address is invalid (--input XXX | -i XXX).\n");
 		exit(EXIT_FAILURE);
 	}
+	if (ts->rotate_secs < 1)
+		die("Seconds must be at least 1.");
+	// Allow short files to be rotated close to the requested time
+	ts->packet_max_time = PACKET_MAX_TIME;
+	if (ts->rotate_secs * 100 < ts->packet_max_time)
+		ts->packet_max_time = ts->rotate_secs * 100;
+	if (ts->busy_poll && !ts->latency)
+		ts->latency = LATENCY_BUDGET;
+	if (ts->latency && ts->latency < ts->packet_max_time)
+		ts->packet_max_time = ts->latency;
+	if (ts->input.fec && ts->input.type != RTP)
+		die("FEC is supported only for RTP input.");
+	if (ts->input2.hostname && (ts->input.type != RTP || ts->input2.type != RTP))
+		die("Merging two inputs is supported only for RTP input.");
 
 	p_info("Prefix     : %s\n", ts->prefix);
 	p_info("Input addr : %s://%s:%s/\n",
 		ts->input.type == UDP ? "udp" :
 		ts->input.type == RTP ? "rtp" : "???",
 		ts->input.hostname, ts->input.service);
+	if (ts->input2.hostname)
+		p_info("Input addr2: rtp://%s:%s/\n", ts->input2.hostname, ts->input2.service);
+	if (ts->input.fec)
+		p_info("Input FEC  : column port+2, row port+4\n");
+	for (j = 0; j < ts->num_forward; j++)
+		p_info("Forward    : %s://%s:%s/\n", ts->forward[j].type == RTP ? "rtp" : "udp",
+			ts->forward[j].hostname, ts->forward[j].service);
+	if (ts->busy_poll)
+		p_info("Busy poll  : CPU %d\n", ts->busy_poll_cpu);
+	if (ts->latency)
+		p_info("Latency    : write within %d ms after arrival\n", ts->packet_max_time);
 	p_info("Seconds    : %u\n", ts->rotate_secs);
 	p_info("Output dir : %s (create directories: %s)\n", ts->output_dir,
 		ts->create_dirs ? "YES" : "no");
+	if (ts->archive_dir) {
+		// The files are moved after chdir() to output dir
+		char *archive_dir = realpath(ts->archive_dir, NULL);
+		if (!archive_dir)
+			die("Can not use archive directory %s: %s\n", ts->archive_dir, strerror(errno));
+		ts->archive_dir = archive_dir;
+		if (ts->archive_rate)
+			p_info("Archive dir: %s (max %llu MB/s)\n", ts->archive_dir, ts->archive_rate / (1024 * 1024));
+		else
+			p_info("Archive dir: %s\n", ts->archive_dir);
+	}
+	if (ts->manifest)
+		p_info("Manifest   : NAME.manifest with CRC32C, PCR and loss counters\n");
+	if (ts->writers && !ts->programs)
+		die("--writers can be used only with --programs.");
+	if (ts->programs)
+		p_info("Programs   : %s%s\n", ts->programs, ts->writers ? " (writer threads)" : "");
+	if (ts->hls_playlist)
+		p_info("Playlist   : %s (%s)\n", ts->hls_playlist,
+			ts->hls_window ? "sliding window" : "event");
+	if (ts->max_age || ts->max_bytes)
+		p_info("Keep files : max age %ld sec, max size %llu MB, delete rate %d files/sec\n",
+			(long)ts->max_age, ts->max_bytes / (1024 * 1024), ts->delete_rate);
 	if (chdir(ts->output_dir) < 0)
 		die("Can not change directory to %s: %s\n", ts->output_dir, strerror(errno));
 }
@@ -154,6 +306,7 @@ static void clear_packet(struct packet *p) {
 	p->ts.tv_sec  = 0;
 	p->ts.tv_usec = 0;
 	p->data_len   = 0;
+	p->lost       = 0;
 	p->allocated  = 0;
 	p->in_use     = 0;
 }
@@ -162,7 +315,7 @@ struct packet *alloc_packet(struct ts *ts) {
 	// check for free static allocations
 	struct packet *p;
 	int i;
-	for (i = 0; i < NUM_PACKETS; i++) {
+	for (i = 0; i < ts->num_packets; i++) {
 		p = &ts->packets[i];
 		if (!p->in_use) {
 			p->in_use = 1;
@@ -171,10 +324,11 @@ struct packet *alloc_packet(struct ts *ts) {
 		}
 	}
 	// Dynamically allocate packet
-	p = malloc(sizeof(struct packet));
+	p = malloc(sizeof(struct packet) + PACKET_MAX_LENGTH);
 	if (!p)
-		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct packet));
+		die("Can't alloc %lu bytes.\n", (unsigned long)(sizeof(struct packet) + PACKET_MAX_LENGTH));
 	clear_packet(p);
+	p->data      = (uint8_t *)(p + 1);
 	p->num       = time(NULL);
 	p->allocated = 1;
 	p_dbg2("ALLOC  packet, num %d\n", p->num);
@@ -191,17 +345,26 @@ void free_packet(struct packet *packet) {
 	free(packet);
 }
 
-#define RTP_HDR_SZ  12
+// Take what is already waiting first, the forwarded datagrams are sent before blocking
+static ssize_t input_read(struct ts *ts, uint8_t *buf, size_t buf_size) {
+	if (ts->fanout) {
+		ssize_t readen = recv(ts->input.fd, buf, buf_size, MSG_DONTWAIT);
+		if (readen >= 0)
+			return readen;
+		fanout_flush(ts);
+	}
+	return fdread_ex(ts->input.fd, (char *)buf, buf_size, 250, 4, 1);
+}
 
 static uint8_t ts_packet[FRAME_SIZE + RTP_HDR_SZ];
 static uint8_t rtp_hdr[2][RTP_HDR_SZ];
 static struct ts ts;
 
 int main(int argc, char **argv) {
-	int i;
 	int have_data = 1;
 	int ntimeouts = 0;
 	int rtp_hdr_pos = 0, num_packets = 0;
+	uint16_t rtp_seq = 0;
 	struct rlimit rl;
 
 	if (getrlimit(RLIMIT_STACK, &rl) == 0) {
@@ -214,16 +377,17 @@ int main(int argc, char **argv) {
 	memset(rtp_hdr[0], 0, RTP_HDR_SZ);
 	memset(rtp_hdr[1], 0, RTP_HDR_SZ);
 
-	for (i = 0; i < NUM_PACKETS; i++) {
-		struct packet *p = &ts.packets[i];
-		p->num = i + 1;
-	}
-
 	ts.ts_discont     = 1;
 	ts.output_dir     = ".";
 	ts.rotate_secs    = 60;
-	ts.current_packet = alloc_packet(&ts);
-	ts.output_fd      = -1;
+	ts.delete_rate    = 10;
+	ts.hls_window     = 6;
+	ts.num_packets    = NUM_PACKETS;
+	ts.input.fec_fd[0] = -1;
+	ts.input.fec_fd[1] = -1;
+	ts.input2.fd       = -1;
+	ts.input2.fec_fd[0] = -1;
+	ts.input2.fec_fd[1] = -1;
 
 	pthread_attr_init(&ts.thread_attr);
 	size_t stack_size;
@@ -231,10 +395,26 @@ int main(int argc, char **argv) {
 	if (stack_size > THREAD_STACK_SIZE)
 		pthread_attr_setstacksize(&ts.thread_attr, THREAD_STACK_SIZE);
 
+	log_init(&ts);
 	parse_options(&ts, argc, argv);
 
+	arena_init(&ts);
+	ts.current_packet = alloc_packet(&ts);
 	ts.packet_queue   = queue_new();
 
+	if (ts.input.fec)
+		fec_init(&ts);
+	if (ts.input2.hostname)
+		merge_init(&ts);
+	if (ts.max_age || ts.max_bytes)
+		retention_init(&ts);
+	if (ts.programs)
+		demux_init(&ts);
+	if (ts.manifest)
+		crc32c_init();
+	if (ts.latency)
+		lowlat_init(&ts);
+
 	p_info("Start %s\n", program_id);
 
 	switch (ts.input.type) {
@@ -242,8 +422,12 @@ int main(int argc, char **argv) {
 	case RTP:
 		if (udp_connect_input(&ts.input) < 1)
 			exit(EXIT_FAILURE);
+		if (ts.merge && udp_connect_input(&ts.input2) < 1)
+			exit(EXIT_FAILURE);
 		break;
 	}
+	if (ts.num_forward)
+		fanout_init(&ts);
 
 	signal(SIGCHLD, SIG_IGN);
 	signal(SIGPIPE, SIG_IGN);
@@ -253,16 +437,27 @@ int main(int argc, char **argv) {
 
 	pthread_create(&ts.write_thread , &ts.thread_attr, &write_thread , &ts);
 
+	if (ts.lowlat)
+		lowlat_start(&ts);
+
 	int data_received = 0;
 	do {
 		ssize_t readen = -1;
 		set_log_io_errors(0);
 		switch (ts.input.type) {
 		case UDP:
-			readen = fdread_ex(ts.input.fd, (char *)ts_packet, FRAME_SIZE, 250, 4, 1);
+			if (ts.busy_poll)
+				readen = lowlat_read(&ts, ts_packet, FRAME_SIZE, 250);
+			else
+				readen = input_read(&ts, ts_packet, FRAME_SIZE);
 			break;
 		case RTP:
-			readen = fdread_ex(ts.input.fd, (char *)ts_packet, FRAME_SIZE + RTP_HDR_SZ, 250, 4, 1);
+			if (ts.busy_poll)
+				readen = lowlat_read(&ts, ts_packet, FRAME_SIZE + RTP_HDR_SZ, 250);
+			else if (ts.merge)
+				readen = merge_read(&ts, ts_packet, FRAME_SIZE + RTP_HDR_SZ, 250);
+			else
+				readen = input_read(&ts, ts_packet, FRAME_SIZE + RTP_HDR_SZ);
 			if (readen > RTP_HDR_SZ) {
 				memcpy(rtp_hdr[rtp_hdr_pos], ts_packet, RTP_HDR_SZ);
 				memmove(ts_packet, ts_packet + RTP_HDR_SZ, FRAME_SIZE);
@@ -270,17 +465,30 @@ int main(int argc, char **argv) {
 				uint16_t ssrc  = (rtp_hdr[rtp_hdr_pos][2] << 8) | rtp_hdr[rtp_hdr_pos][3];
 				uint16_t pssrc = (rtp_hdr[!rtp_hdr_pos][2] << 8) | rtp_hdr[!rtp_hdr_pos][3];
 				rtp_hdr_pos = !rtp_hdr_pos;
-				if (pssrc + 1 != ssrc && (ssrc != 0 && pssrc != 0xffff) && num_packets > 2)
-					if (ts.ts_discont)
+				rtp_seq = ssrc;
+				if (pssrc + 1 != ssrc && (ssrc != 0 && pssrc != 0xffff) && num_packets > 2) {
+					int lost = ((ssrc - pssrc)-1) & 0xffff;
+					if (!ts.fec && !ts.merge)
+						ts.current_packet->lost += lost;
+					if (ts.ts_discont && !ts.fec && !ts.merge && log_event(LOG_EV_RTP_DISCONT, lost))
 						p_info(" *** RTP discontinuity last_ssrc %5d, curr_ssrc %5d, lost %d packet ***\n",
-							pssrc, ssrc, ((ssrc - pssrc)-1) & 0xffff);
+							pssrc, ssrc, lost);
+				}
 				num_packets++;
 			}
 			break;
 		}
 		set_log_io_errors(1);
 		if (readen < 0) {
-			p_info(" *** Input read timeout ***\n");
+			if (log_event(LOG_EV_READ_TIMEOUT, 250))
+				p_info(" *** Input read timeout ***\n");
+			if (ts.fanout)
+				fanout_flush(&ts);
+			if (ts.latency) {
+				struct timeval now;
+				gettimeofday(&now, NULL);
+				process_flush(&ts, &now);
+			}
 			data_received = 0;
 			ntimeouts++;
 		} else {
@@ -294,12 +502,32 @@ int main(int argc, char **argv) {
 				data_received = 1;
 			}
 			total_read += readen;
-			process_packets(&ts, ts_packet, readen);
+			if (ts.fec)
+				fec_add_media(&ts, rtp_seq, ts_packet, readen);
+			else
+				process_packets(&ts, ts_packet, readen);
 		}
+		if (ts.fec)
+			fec_read(&ts);
+		if (ts.merge)
+			merge_report(&ts, 0);
+		if (ts.fanout)
+			fanout_report(&ts, 0);
 		if (!keep_running)
 			break;
 	} while (have_data);
 
+	if (ts.fec) {
+		fec_flush(&ts);
+		fec_report(&ts, 1);
+	}
+	if (ts.merge)
+		merge_report(&ts, 1);
+	if (ts.fanout) {
+		fanout_flush(&ts);
+		fanout_report(&ts, 1);
+	}
+
 	queue_add(ts.packet_queue, ts.current_packet);
 	queue_add(ts.packet_queue, NULL); // Exit write_thread
 	pthread_join(ts.write_thread, NULL);
@@ -307,7 +535,24 @@ int main(int argc, char **argv) {
 	p_info("Stop %s (bytes_processed:%llu).\n", program_id, total_read);
 
 	queue_free(&ts.packet_queue);
-
+	arena_free(&ts);
+
+	if (ts.retention)
+		retention_free(&ts);
+	if (ts.demux)
+		demux_free(&ts);
+
+	if (ts.fec)
+		fec_free(&ts);
+	if (ts.merge)
+		merge_free(&ts);
+	if (ts.fanout)
+		fanout_free(&ts);
+	if (ts.lowlat)
+		lowlat_free(&ts);
+
+	free(ts.archive_dir);
+	log_free();
 	pthread_attr_destroy(&ts.thread_attr);
 
 	exit(EXIT_SUCCESS);
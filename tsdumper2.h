@@ -17,6 +17,7 @@
 
 #include <pthread.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdbool.h>
 
 #include "libfuncs/libfuncs.h"
@@ -24,9 +25,13 @@
 // Supported values 0, 1 and 2. Higher value equals more spam in the log.
 #define DEBUG 0
 
+#define TS_PACKET_SIZE 188
+
 // 7 * 188
 #define FRAME_SIZE 1316
 
+#define RTP_HDR_SZ 12
+
 // 64k should be enough for everybody
 #define THREAD_STACK_SIZE (64 * 1024)
 
@@ -44,8 +49,29 @@ enum io_type {
 #define PREFIX_MAX_LENGTH 64
 
 // PREFIX-20130717_000900-1374008940.ts (PREFIX-YYYYMMDD_HHMMSS-0123456789.ts)
+// PREFIX-65535-20130717_000900-1374008940.ts (when programs are split)
 #define OUTFILE_NAME_MAX  (PREFIX_MAX_LENGTH + 128)
 
+// Maximum number of --writers threads
+#define WRITERS_MAX 16
+
+// Default --latency with --busy-poll (ms)
+#define LATENCY_BUDGET 10
+
+// How often the manifest of the file that is being written is saved
+#define MANIFEST_SAVE_SECS 1
+
+// Maximum number of --forward destinations
+#define FORWARD_MAX 8
+
+// Maximum number of programs that can be split into separate files
+#define MAX_OUTPUTS 64
+
+// strftime() formats used for file and directory names
+#define OUTFILE_NAME_FMT  "%Y%m%d_%H%M%S-%s.ts"
+#define OUTFILE_DIR_FMT   "%Y/%m/%d/%H"
+
+// Default number of static packets (--buffers)
 #define NUM_PACKETS 16
 
 struct packet {
@@ -54,7 +80,8 @@ struct packet {
 	int					allocated;					// set to true if the struct is dynamically allocated
 	int					in_use;						// this packet is currently being used
 	int					data_len;					// data length
-	uint8_t				data[PACKET_MAX_LENGTH];	// the data
+	int					lost;						// input packets lost while filling it
+	uint8_t				*data;						// PACKET_MAX_LENGTH bytes
 };
 
 struct io {
@@ -62,30 +89,139 @@ struct io {
 	enum io_type		type;
 	char				*hostname;
 	char				*service;
+	int					fec;						// receive SMPTE 2022-1 FEC on port+2 and port+4
+	int					fec_fd[2];					// column and row FEC sockets
+};
+
+struct arena;
+struct fec;
+struct merge;
+struct fanout;
+struct retention;
+struct migrate;
+struct lowlat;
+struct playlist;
+
+// Section of PSI table collected from TS packets
+struct psi_buf {
+	uint8_t				data[1024 + TS_PACKET_SIZE];
+	int					len;
+	int					cc;
+};
+
+struct pcr_info {
+	int					pid;						// -1 == not known yet
+	int					count;
+	uint64_t			first;
+	uint64_t			last;
+	off_t				first_pos;					// file offset of the packet with the first PCR
+	off_t				last_pos;
+};
+
+struct output;
+struct write_job;
+
+struct output_file {
+	int					fd;
+	time_t				startts;
+	char				dirname[OUTFILE_NAME_MAX];
+	char				filename[OUTFILE_NAME_MAX];
+	char				full_filename[OUTFILE_NAME_MAX];
+	off_t				size;
+	struct pcr_info		pcr;
+	uint32_t			crc32c;						// of the data written so far
+	unsigned long		cc_errors;
+	unsigned long		input_lost;					// input packets lost while writing the file
+	time_t				saved;						// when the manifest was saved
+	int					keep;						// stays in staging to be appended after restart
+	struct output		*out;						// file set of this file
+	struct output_file	*next_close;
+};
+
+/*
+ * One recorded file set. When programs are not split there is only one
+ * output with program 0, otherwise there is one output per program.
+ */
+struct output {
+	int					index;						// position in ts->outputs (-1 == file left by previous run)
+	int					program;					// 0 == the whole input
+	char				prefix[PREFIX_MAX_LENGTH + 8];
+	struct output_file	*file;						// file that is being written
+	time_t				startts;
+	struct playlist		*playlist;
+	uint8_t				cc[8192];					// last continuity counter of each PID
+
+	// Protected by struct rotate lock
+	time_t				want;						// start time of the file to prepare
+	time_t				preparing;					// file that is being created (0 == none)
+	struct output_file	*next;						// prepared file
+	struct output_file	save;						// state of the file for the manifest
+	int					save_pending;				// save is not written yet
+
+	// Packets of the current chunk that belong to this output
+	uint8_t				*batch;
+	int					batch_len;
+	int					batch_size;
+
+	// Protected by struct writer lock
+	struct write_job	*jobs;						// batches waiting to be written
+	struct write_job	*jobs_tail;
+	struct output		*runq_next;
+	int					busy;						// a writer thread is writing it
+	struct write_job	*free_jobs;					// written jobs with their buffers
 };
 
+struct rotate;
+struct demux;
+struct writer;
+
 struct ts {
 	char				*prefix;
 	char				*output_dir;
 	int					create_dirs;
 	int					rotate_secs;
 	int					ts_discont;
+	time_t				max_age;					// delete files older than this (0 == keep)
+	unsigned long long	max_bytes;					// delete old files above this size (0 == keep)
+	int					delete_rate;				// files deleted per second
+	char				*hls_playlist;
+	int					hls_window;					// segments in the playlist, 0 == EVENT playlist
+	int					packet_max_time;			// maximum packet fill time in ms
+	char				*programs;					// programs to split ("all" or list)
+	int					writers;					// writer threads (0 == write_thread)
+	int					manifest;					// write NAME.manifest with CRC32C for each file
+	char				*archive_dir;				// move closed files here (NULL == keep)
+	unsigned long long	archive_rate;				// bytes per second (0 == unlimited)
+	int					busy_poll;					// spin on the input instead of sleeping
+	int					busy_poll_cpu;				// CPU of the input thread
+	int					latency;					// chunk handoff budget in ms (0 == not set)
 	struct io			input;
+	struct io			input2;						// redundant copy of input (merged by RTP seq)
+	struct io			forward[FORWARD_MAX];		// send the received stream here
+	int					num_forward;
 
 	pthread_attr_t		thread_attr;
 	pthread_t			write_thread;
 
-	struct packet		packets[NUM_PACKETS];
-	int					packet_ptr;
+	struct packet		*packets;					// static packets, data is in the arena
+	int					num_packets;
+	struct arena		*arena;
 
 	struct packet		*current_packet;
 	QUEUE				*packet_queue;
 
-	int					output_fd;
-	time_t				output_startts;
-	char				output_dirname[OUTFILE_NAME_MAX];
-	char				output_filename[OUTFILE_NAME_MAX];
-	char				output_full_filename[OUTFILE_NAME_MAX];
+	struct fec			*fec;
+	struct merge		*merge;
+	struct fanout		*fanout;
+	struct retention	*retention;
+	struct migrate		*migrate;
+	struct lowlat		*lowlat;
+	struct demux		*demux;
+	struct writer		*writer;
+
+	struct output		*outputs[MAX_OUTPUTS];
+	int					num_outputs;
+	struct rotate		*rotate;
 };
 
 #include "util.h"
@@ -94,11 +230,106 @@ struct ts {
 struct packet *alloc_packet(struct ts *ts);
 void free_packet(struct packet *packet);
 
+// From arena.c
+void arena_init(struct ts *ts);
+void arena_free(struct ts *ts);
+
+// From demux.c
+void demux_init(struct ts *ts);
+void demux_free(struct ts *ts);
+void demux_packet(struct ts *ts, struct packet *packet);
+
+// From log.c
+enum log_event_type {
+	LOG_EV_RTP_DISCONT,
+	LOG_EV_READ_TIMEOUT,
+	LOG_EV_WRITE_ERROR,
+	LOG_EV_MAX
+};
+
+void log_init(struct ts *ts);
+void log_free(void);
+void log_flush(void);
+void log_vwrite(int err, const char *fmt, va_list args);
+int log_event(enum log_event_type type, unsigned long long value);
+
+// From lowlat.c
+void lowlat_init(struct ts *ts);
+void lowlat_free(struct ts *ts);
+void lowlat_start(struct ts *ts);
+ssize_t lowlat_read(struct ts *ts, uint8_t *buf, size_t buf_size, int timeout);
+void lowlat_written(struct ts *ts, struct timeval *arrival);
+
+// From manifest.c
+void crc32c_init(void);
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len);
+void manifest_update(struct output *out, struct output_file *o, uint8_t *data, int data_len);
+off_t manifest_resume(struct output *out, struct output_file *o, const char *path);
+void manifest_write(struct output_file *o, const char *path, int complete);
+
+// From migrate.c
+void migrate_init(struct ts *ts, mode_t dir_perm);
+void migrate_free(struct ts *ts);
+void migrate_add(struct ts *ts, struct output_file *o);
+
+// From mpegts.c
+uint32_t ts_crc32(uint8_t *data, int len);
+int psi_push(struct psi_buf *psi, uint8_t *pkt);
+unsigned int cc_scan(uint8_t *cc, uint8_t *data, int data_len);
+uint64_t pcr_diff(uint64_t from, uint64_t to);
+void pcr_reset(struct pcr_info *pcr);
+void pcr_scan(struct pcr_info *pcr, uint8_t *data, int data_len, off_t pos);
+double pcr_duration(struct pcr_info *pcr, off_t size);
+
+// From playlist.c
+void playlist_init(struct ts *ts, struct output *out);
+void playlist_add(struct output *out, char *uri, struct pcr_info *pcr, off_t size, double default_duration);
+void playlist_free(struct output *out);
+
 // From process.c
+struct output *output_new(struct ts *ts, int program);
+void output_write(struct ts *ts, struct output *out, time_t packet_time, int lost, uint8_t *data, int data_len);
 void *write_thread(void *_ts);
 void process_packets(struct ts *ts, uint8_t *ts_packet, ssize_t readen);
+void process_flush(struct ts *ts, struct timeval *now);
+
+// From fanout.c
+void fanout_init(struct ts *ts);
+void fanout_free(struct ts *ts);
+void fanout_add(struct ts *ts, uint8_t *data, ssize_t len);
+void fanout_flush(struct ts *ts);
+void fanout_report(struct ts *ts, int force);
+
+// From fec.c
+void fec_init(struct ts *ts);
+void fec_free(struct ts *ts);
+void fec_add_media(struct ts *ts, uint16_t seq, uint8_t *data, ssize_t len);
+void fec_read(struct ts *ts);
+void fec_flush(struct ts *ts);
+void fec_report(struct ts *ts, int force);
+
+// From merge.c
+void merge_init(struct ts *ts);
+void merge_free(struct ts *ts);
+ssize_t merge_read(struct ts *ts, uint8_t *buf, size_t buf_size, int timeout);
+void merge_report(struct ts *ts, int force);
+
+// From retention.c
+typedef int (*segment_scan_cb)(struct ts *ts, const char *path, time_t start, int program, void *data);
+
+void retention_init(struct ts *ts);
+void retention_free(struct ts *ts);
+void retention_open(struct ts *ts, struct output *out, time_t start);
+void retention_add(struct ts *ts, struct output *out, time_t start, off_t size);
+void segment_scan(struct ts *ts, const char *dirname, segment_scan_cb fn, void *data);
 
 // From udp.c
 int udp_connect_input(struct io *io);
+int udp_connect_output(struct io *io);
+
+// From writer.c
+void writer_init(struct ts *ts);
+void writer_free(struct ts *ts);
+void writer_add(struct ts *ts, struct output *out, struct packet *packet);
 
 #endif
@@ -22,6 +22,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <errno.h>
 
 #include "tsdumper2.h"
@@ -121,15 +122,14 @@ static int join_multicast_group(int sock, struct sockaddr_storage *addr) {
 	return 0;
 }
 
-int udp_connect_input(struct io *io) {
+static int udp_connect(const char *hostname, const char *service, int *fd) {
 	struct sockaddr_storage addr;
 	int addrlen = sizeof(addr);
 	int sock = -1;
 
 	memset(&addr, 0, sizeof(addr));
 
-	p_info("Connecting input to %s port %s\n", io->hostname, io->service);
-	if (bind_addr(io->hostname, io->service, SOCK_DGRAM, &addr, &addrlen, &sock) < 0)
+	if (bind_addr(hostname, service, SOCK_DGRAM, &addr, &addrlen, &sock) < 0)
 		return -1;
 
 	/* Set receive buffer size to ~4.0MB */
@@ -143,8 +143,82 @@ int udp_connect_input(struct io *io) {
 		}
 	}
 
-	io->fd = sock;
+	*fd = sock;
+	return 0;
+}
+
+static int udp_connect_fec(struct io *io) {
+	static const char *fec_names[2] = { "column", "row" };
+	char fec_service[16];
+	int i, port = atoi(io->service);
+
+	if (port < 1 || port > 65535 - 4) {
+		p_info("ERROR: FEC needs numeric input port (port: %s)\n", io->service);
+		return -1;
+	}
+
+	// SMPTE 2022-1: column FEC is on port+2, row FEC is on port+4
+	for (i = 0; i < 2; i++) {
+		snprintf(fec_service, sizeof(fec_service), "%d", port + (i + 1) * 2);
+		p_info("Connecting %s FEC to %s port %s\n", fec_names[i], io->hostname, fec_service);
+		if (udp_connect(io->hostname, fec_service, &io->fec_fd[i]) < 0)
+			return -1;
+		p_info("FEC %s connected to fd:%d\n", fec_names[i], io->fec_fd[i]);
+	}
+
+	return 0;
+}
+
+int udp_connect_input(struct io *io) {
+	p_info("Connecting input to %s port %s\n", io->hostname, io->service);
+	if (udp_connect(io->hostname, io->service, &io->fd) < 0)
+		return -1;
+
 	p_info("Input connected to fd:%d\n", io->fd);
 
+	if (io->fec && udp_connect_fec(io) < 0)
+		return -1;
+
 	return 1;
 }
+
+int udp_connect_output(struct io *io) {
+	struct addrinfo hints, *res, *ressave;
+	int n;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = ai_family;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	n = getaddrinfo(io->hostname, io->service, &hints, &res);
+	if (n != 0) {
+		p_info("ERROR: getaddrinfo(%s): %s\n", io->hostname, gai_strerror(n));
+		return -1;
+	}
+
+	io->fd = -1;
+	for (ressave = res; res; res = res->ai_next) {
+		int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (sock < 0)
+			continue;
+		if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
+			io->fd = sock;
+			break;
+		}
+		close(sock);
+	}
+	freeaddrinfo(ressave);
+
+	if (io->fd < 0) {
+		p_err("Can't connect to %s port %s", io->hostname, io->service);
+		return -1;
+	}
+
+	/* Queue bursts in the kernel instead of dropping them */
+	int bufsize = (4000000 / 1316) * 1316;
+	setsockopt(io->fd, SOL_SOCKET, SO_SNDBUF, (void *)&bufsize, sizeof(bufsize));
+	set_sock_nonblock(io->fd);
+
+	p_info("Forward to %s port %s connected to fd:%d\n", io->hostname, io->service, io->fd);
+	return 0;
+}
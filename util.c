@@ -29,16 +29,32 @@
 
 #ifdef __linux__
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 
 void set_thread_name(char *thread_name) {
 	prctl(PR_SET_NAME, thread_name, NULL, NULL, NULL);
 }
 
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+// Lowest CPU and idle I/O priority for the calling thread
+void set_thread_low_prio(void) {
+	pid_t tid = syscall(SYS_gettid);
+	setpriority(PRIO_PROCESS, tid, 19);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
 #else
 void set_thread_name(char *thread_name) {
     (void)thread_name;
 }
 
+void set_thread_low_prio(void) {
+}
+
 #endif
 
 int parse_host_and_port(char *input, struct io *io) {
@@ -131,6 +147,7 @@ OUT:
 
 void die(const char *fmt, ...) {
 	va_list args;
+	log_flush();
 	va_start(args, fmt);
 	fprintf(stderr, "ERROR: ");
 	vfprintf(stderr, fmt, args);
@@ -143,30 +160,13 @@ void die(const char *fmt, ...) {
 void p_err(const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "ERROR: ");
-	vfprintf(stderr, fmt, args);
-	if (fmt[strlen(fmt) - 1] != '\n')
-		fprintf(stderr, "\n");
+	log_vwrite(1, fmt, args);
 	va_end(args);
 }
 
 void p_info(const char *fmt, ...) {
-	if (DEBUG > 0) {
-		struct timeval tv;
-		gettimeofday(&tv, NULL);
-		fprintf(stdout, "%08ld.%08ld ", (long)tv.tv_sec, (long)tv.tv_usec);
-
-		char date[64];
-		struct tm tm;
-		localtime_r(&tv.tv_sec, &tm);
-		strftime(date, sizeof(date), "%F %H:%M:%S", localtime_r(&tv.tv_sec, &tm));
-		fprintf(stdout, "%s | ", date);
-	}
 	va_list args;
 	va_start(args, fmt);
-	vfprintf(stdout, fmt, args);
-	if (fmt[strlen(fmt) - 1] != '\n')
-		fprintf(stdout, "\n");
+	log_vwrite(0, fmt, args);
 	va_end(args);
-	fflush(stdout);
 }
@@ -19,6 +19,7 @@
 #include <arpa/inet.h>
 
 void set_thread_name(char *thread_name);
+void set_thread_low_prio(void);
 
 int parse_host_and_port(char *input, struct io *io);
 char *my_inet_ntop(int family, struct sockaddr *addr, char *dest, int dest_len);
@@ -0,0 +1,214 @@
+/*
+ * Pool of writer threads for the outputs
+ * Copyright (C) 2013 Unix Solutions Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License (COPYING file) for more details.
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tsdumper2.h"
+
+/*
+ * When programs are split, write_thread only demuxes the chunks and the
+ * per program batches are written by a pool of --writers threads. All
+ * files are in the output directory, so the pool size is fixed and does
+ * not depend on the number of programs.
+ *
+ * Every output has a FIFO of jobs. An output with jobs is in the run
+ * queue and any idle thread takes it with all its jobs, so the jobs of
+ * one output are written in order by one thread at a time while
+ * different outputs are written in parallel.
+ *
+ * Written jobs are kept with their buffers in the free list of the
+ * output and the batch is swapped with one of them, so the demux thread
+ * does not allocate (or grow) the buffers once the lists are filled.
+ */
+struct write_job {
+	struct write_job	*next;
+	struct timeval		arrival;					// of the packet the batch is from
+	int					lost;
+	uint8_t				*data;
+	int					data_len;
+	int					data_size;
+};
+
+struct writer {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int					quit;
+	struct output		*runq;						// outputs with jobs (FIFO)
+	struct output		*runq_tail;
+	int					num_threads;
+	pthread_t			threads[WRITERS_MAX];
+	unsigned int		pending;					// jobs not written yet
+	unsigned int		max_pending;
+
+	unsigned long long	jobs;
+	unsigned long long	bytes;
+};
+
+static void runq_push(struct writer *w, struct output *out) {
+	out->runq_next = NULL;
+	if (w->runq_tail)
+		w->runq_tail->runq_next = out;
+	else
+		w->runq = out;
+	w->runq_tail = out;
+	pthread_cond_signal(&w->cond);
+}
+
+static struct output *runq_pop(struct writer *w) {
+	struct output *out = w->runq;
+	if (out) {
+		w->runq = out->runq_next;
+		if (!w->runq)
+			w->runq_tail = NULL;
+	}
+	return out;
+}
+
+static void *writer_thread(void *_ts) {
+	struct ts *ts = _ts;
+	struct writer *w = ts->writer;
+
+	set_thread_name("tsdump-writer");
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		struct output *out = runq_pop(w);
+		if (!out) {
+			if (w->quit)
+				break;
+			pthread_cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+		struct write_job *job = out->jobs;
+		out->jobs      = NULL;
+		out->jobs_tail = NULL;
+		out->busy      = 1;
+		pthread_mutex_unlock(&w->lock);
+
+		struct write_job *first = job, *last = job;
+		unsigned int done = 0;
+		unsigned long long bytes = 0;
+		for (; job; job = job->next) {
+			output_write(ts, out, job->arrival.tv_sec, job->lost, job->data, job->data_len);
+			if (ts->lowlat)
+				lowlat_written(ts, &job->arrival);
+			bytes += job->data_len;
+			last = job;
+			done++;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		last->next     = out->free_jobs; // Recycle the jobs and their buffers
+		out->free_jobs = first;
+		out->busy      = 0;
+		if (out->jobs) // More jobs came while writing
+			runq_push(w, out);
+		w->pending -= done;
+		w->jobs    += done;
+		w->bytes   += bytes;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+void writer_init(struct ts *ts) {
+	struct writer *w = calloc(1, sizeof(struct writer));
+	int i;
+	if (!w)
+		die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct writer));
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	ts->writer = w;
+	for (i = 0; i < ts->writers; i++) {
+		if (pthread_create(&w->threads[i], &ts->thread_attr, &writer_thread, ts) == 0)
+			w->num_threads++;
+	}
+	if (!w->num_threads)
+		die("Can't start writer threads.");
+	p_info("Writers    : %d threads\n", w->num_threads);
+}
+
+// Write all queued jobs and stop the threads
+void writer_free(struct ts *ts) {
+	struct writer *w = ts->writer;
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->quit = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 0; i < w->num_threads; i++)
+		pthread_join(w->threads[i], NULL);
+	for (i = 0; i < ts->num_outputs; i++) {
+		struct output *out = ts->outputs[i];
+		while (out->free_jobs) {
+			struct write_job *job = out->free_jobs;
+			out->free_jobs = job->next;
+			free(job->data);
+			free(job);
+		}
+	}
+	p_info("Writers    : %llu writes, %llu bytes\n", w->jobs, w->bytes);
+	if (w->max_pending)
+		p_info("Writers    : max %u writes waiting\n", w->max_pending);
+
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	free(w);
+	ts->writer = NULL;
+}
+
+/*
+ * Queue the batch of the output to be written, the job takes out->batch
+ * and the output gets the buffer of the recycled job.
+ */
+void writer_add(struct ts *ts, struct output *out, struct packet *packet) {
+	struct writer *w = ts->writer;
+
+	pthread_mutex_lock(&w->lock);
+	struct write_job *job = out->free_jobs;
+	if (job) {
+		out->free_jobs = job->next;
+	} else {
+		job = calloc(1, sizeof(struct write_job));
+		if (!job)
+			die("Can't alloc %lu bytes.\n", (unsigned long)sizeof(struct write_job));
+	}
+	uint8_t *data    = job->data;
+	int data_size    = job->data_size;
+	job->next        = NULL;
+	job->arrival     = packet->ts;
+	job->lost        = packet->lost;
+	job->data        = out->batch;
+	job->data_len    = out->batch_len;
+	job->data_size   = out->batch_size;
+	out->batch      = data;
+	out->batch_len  = 0;
+	out->batch_size = data_size;
+
+	if (out->jobs_tail)
+		out->jobs_tail->next = job;
+	else
+		out->jobs = job;
+	int was_idle = out->jobs == job && !out->busy;
+	out->jobs_tail = job;
+	if (was_idle)
+		runq_push(w, out);
+	if (++w->pending > w->max_pending)
+		w->max_pending = w->pending;
+	pthread_mutex_unlock(&w->lock);
+}